@@ -0,0 +1,116 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator for the IR of one procedure.
+// Objects are never freed one at a time; release() drops all of them at once.
+class Arena {
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+	};
+	struct Dtor {
+		Dtor *next;
+		void (*destroy)(void *);
+		void *obj;
+	};
+	static const size_t chunk_size = 16384;
+	Chunk *chunks = nullptr;
+	Dtor *dtors = nullptr;
+	char *cur = nullptr;
+	char *end = nullptr;
+	size_t _used = 0;
+	size_t _reserved = 0;
+
+	void *alloc_slow(size_t size, size_t align)
+	{
+		size_t n = sizeof(Chunk)+size+align;
+		if (n < chunk_size)
+			n = chunk_size;
+		Chunk *c = static_cast<Chunk*>(malloc(n));
+		if (!c) {
+			perror("malloc");
+			abort();
+		}
+		c->next = chunks;
+		c->size = n;
+		chunks = c;
+		_reserved += n;
+		cur = reinterpret_cast<char*>(c+1);
+		end = reinterpret_cast<char*>(c)+n;
+		return alloc(size, align);
+	}
+	template<class T>
+	static void destroy(void *p)
+	{
+		static_cast<T*>(p)->~T();
+	}
+public:
+	Arena() {}
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+	~Arena()
+	{
+		release();
+	}
+	void *alloc(size_t size, size_t align)
+	{
+		uintptr_t p = (reinterpret_cast<uintptr_t>(cur)+align-1) & ~(align-1);
+		if (!cur || p+size > reinterpret_cast<uintptr_t>(end))
+			return alloc_slow(size, align);
+		cur = reinterpret_cast<char*>(p+size);
+		_used += size;
+		return reinterpret_cast<void*>(p);
+	}
+	template<class T, class... Args>
+	T *make(Args&&... args)
+	{
+		T *obj = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value) {
+			// e.g. LabelOperand owns a std::string
+			Dtor *d = new (alloc(sizeof(Dtor), alignof(Dtor))) Dtor;
+			d->next = dtors;
+			d->destroy = destroy<T>;
+			d->obj = obj;
+			dtors = d;
+		}
+		return obj;
+	}
+	// zero-filled array of n elements
+	template<class T>
+	T *make_array(size_t n)
+	{
+		static_assert(std::is_trivial<T>::value, "make_array: T must be trivial");
+		T *a = static_cast<T*>(alloc(n*sizeof(T), alignof(T)));
+		memset(a, 0, n*sizeof(T));
+		return a;
+	}
+	void release()
+	{
+		for (Dtor *d = dtors; d; d = d->next)
+			d->destroy(d->obj);
+		dtors = nullptr;
+		while (chunks) {
+			Chunk *next = chunks->next;
+			free(chunks);
+			chunks = next;
+		}
+		cur = end = nullptr;
+		_used = 0;
+		_reserved = 0;
+	}
+	size_t used() const
+	{
+		return _used;
+	}
+	size_t reserved() const
+	{
+		return _reserved;
+	}
+};
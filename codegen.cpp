@@ -1,10 +1,13 @@
 #include <cassert>
 #include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "semant.h"
 #include "dynbitset.h"
@@ -39,6 +42,12 @@ static const char *opins[] = {
 	"cbw",
 	"imul",
 	"idiv",
+	"xor",
+	"shl",
+	"sar",
+	"shr",
+	"imul",
+	"jmp",
 };
 
 void TranslateEnv::emit(const char *ins, Operand *dst, Operand *src)
@@ -73,7 +82,13 @@ bool same_reg(Operand *a, Operand *b)
 }
 #endif
 
-Operand *TranslateEnv::resolve(Operand *o)
+// a param passed in a register may have no slot (see allocaddr())
+static bool has_home(const VarSymbol *vs)
+{
+	return !vs->level || vs->offset;
+}
+
+Operand *TranslateEnv::resolve(Operand *o, bool spilled_only)
 {
 	if (!o)
 		return nullptr;
@@ -82,62 +97,122 @@ Operand *TranslateEnv::resolve(Operand *o)
 		if (t->id >= 0) {
 			int color = temp_reg[t->id];
 			if (color < 0) {
-				// spilled
-				return t->id < scalar_id ?
-					translate_varsym(scalar_var[t->id]) :
-					new MemOperand(t->size, ebp, temp_offset[t->id]);
+				// spilled; the home of an outer scalar may be
+				// off the static link in a temporary, and the
+				// byte view of an integer is its low byte
+				MemOperand *m;
+				if (t->id < scalar_id && has_home(scalar_var[t->id])) {
+					m = translate_varsym(scalar_var[t->id]);
+					m = mem(t->size, m->base, m->offset, m->index, m->scale);
+				} else {
+					m = mem(t->size, ebp, temp_offset[t->id]);
+				}
+				return resolve(fpo ? rebase(m) : m, spilled_only);
 			}
-			return getphysreg(t->size, color);
+			return spilled_only ? o : getphysreg(t->size, color);
 		}
 		return o;
 	}
 	if (o->ismem()) {
 		MemOperand *m = static_cast<MemOperand*>(o);
-		m->base = resolve(m->base);
-		m->index = resolve(m->index);
+		return mem(m->size, resolve(m->base, spilled_only), m->offset,
+			   resolve(m->index, spilled_only), m->scale);
 	}
 	return o;
 }
 
-void TranslateEnv::gencode()
+// o with its frame addresses based at esp on entry instead of ebp (see
+// gencode()): the args lose the 4 bytes of the saved ebp, the locals keep
+// their offsets.
+Operand *TranslateEnv::rebase(Operand *o)
+{
+	if (!o || !o->ismem())
+		return o;
+	MemOperand *m = asmem(o);
+	if (m->base == ebp)
+		return mem(m->size, esp, m->offset > 0 ? m->offset-4 : m->offset,
+			   rebase(m->index), m->scale);
+	return mem(m->size, rebase(m->base), m->offset, rebase(m->index), m->scale);
+}
+
+void TranslateEnv::regalloc()
 {
 #ifdef DEBUG
-	fprintf(stderr, "gencode: %s\n", procname.c_str());
+	fprintf(stderr, "regalloc: %s\n", procname.c_str());
 #endif
-	temp_offset.resize(tempid);
+	// A procedure that passes no static link (no procedure nested in it
+	// is called) needs ebp only as the base of its frame; address that
+	// off esp instead and give out ebp as a register.
+	if (opt->optimize) {
+		fpo = true;
+		for (const Quad &q: quads)
+			if (q.c == ebp || q.a == ebp || q.b == ebp)
+				fpo = false;
+	}
+	if (fpo) {
+		for (Quad &q: quads) {
+			q.c = rebase(q.c);
+			q.a = rebase(q.a);
+			q.b = rebase(q.b);
+		}
+	}
+	unsigned char regs = fpo ? 0xef : 0xcf;
+	if (opt->optimize)
+		sink_entry_loads();
 	int offset = -framesize;
-	int maxphysreg = -1;
 	bool spill;
 	int iter = 0;
+	Liveness lv;
+	// Every round colors all the temporaries left, so that a register
+	// taken in an earlier round can go to a reload instead.  The reloads
+	// made by rewrite() (numbered from norig) live from one quad to the
+	// next; spilling one would free no register, only make another.
+	int norig = tempid;
+	vector<char> spilled(norig);
+	// liveness and the graph are updated for the reloads only; a spilled
+	// scalar whose home is off the static link in a temporary makes that
+	// live anew
+	bool rebuild = true;
+	Graph ig(0);
 	do {
 		spill = false;
 #ifdef DEBUG
 		fprintf(stderr, "iter %d:\n", iter);
 		dump_quads();
 #endif
-		rewrite();
+		vector<int> newpos = rewrite();
 #ifdef DEBUG
 		fprintf(stderr, "iter %d after rewrite:\n", iter);
 		dump_quads();
 #endif
-		temp_reg = color_graph(build_interference_graph());
-		// must update maxphysreg after each iteration
-		for (int i=0; i<tempid; i++) {
-			if (maxphysreg < temp_reg[i])
-				maxphysreg = temp_reg[i];
-		}
+		vector<char> free_spill;
+		vector<float> cost = spill_costs(free_spill);
+		for (int i=norig; i<tempid; i++)
+			cost[i] = INFINITY;
+		vector<pair<int,int>> moves = collect_moves();
+		if (rebuild)
+			ig = build_interference_graph(lv);
+		else
+			ig = update_interference_graph(lv, newpos, temp_reg, ig);
+		rebuild = false;
+		temp_reg = color_graph(Graph(ig), cost, moves, regs, &free_spill);
+		spilled.resize(tempid);
+		temp_offset.resize(tempid);
 		// allocate address for spilled temporaries
 		for (int i=0; i<tempid; i++) {
-			if (temp_reg[i] < 0) {
+			if (temp_reg[i] < 0 && !spilled[i]) {
 				spill = true;
+				spilled[i] = true;
 				int scalar = temp_scalar[i];
 #ifdef DEBUG
 				fprintf(stderr, "spill: %d\n", i);
 #endif
-				if (scalar >= 0) {
+				if (scalar >= 0 && has_home(scalar_var[scalar])) {
 #ifdef DEBUG
 					fprintf(stderr, "scalar\n");
 #endif
+					if (link && scalar_var[scalar]->level == level-1)
+						rebuild = true;
 				} else {
 					int size = temps[i]->size;
 					int align = size;
@@ -146,46 +221,346 @@ void TranslateEnv::gencode()
 				}
 			}
 		}
+		// the colored ones stay temporaries until the last round
+		for (int i=0; i<tempid; i++)
+			if (spilled[i])
+				temp_reg[i] = -1;
 		for (Quad &q: quads) {
-			q.c = resolve(q.c);
-			q.a = resolve(q.a);
-			q.b = resolve(q.b);
+			q.c = resolve(q.c, spill);
+			q.a = resolve(q.a, spill);
+			q.b = resolve(q.b, spill);
 		}
 		iter++;
 	} while (spill);
+	for (int i=0; i<tempid; i++) {
+		if (temp_reg[i] >= 0)
+			used_regs |= 1 << temp_reg[i];
+	}
 #ifdef DEBUG
 	fprintf(stderr, "final:\n");
 	dump_quads();
 #endif
 	offset &= ~3;
 	framesize = -offset;
+}
+
+// the blocks of lv as a CFG of empty BBs; reversed, block b is node 1+b,
+// leaving node 0 for the exit
+static vector<unique_ptr<BB>> block_graph(const Liveness &lv, bool reversed)
+{
+	int n = lv.nblock();
+	vector<unique_ptr<BB>> g;
+	for (int b=0; b<n+reversed; b++)
+		g.push_back(make_unique<BB>(b));
+	for (int b=0; b<n; b++) {
+		for (int s: lv.succ[b]) {
+			BB *from = reversed ? g[1+s].get() : g[b].get();
+			BB *to = reversed ? g[1+b].get() : g[s].get();
+			from->succ.push_back(to);
+			to->pred.push_back(from);
+		}
+	}
+	return g;
+}
+
+// whether a store to m may change what a load from l reads: a global and
+// a slot of the frame are apart, as are two globals by name
+static bool may_alias(MemOperand *m, MemOperand *l)
+{
+	auto frame = [](MemOperand *x) {
+		return x->base == ebp || x->base == esp;
+	};
+	auto global = [](MemOperand *x) {
+		return x->base && x->base->islabel();
+	};
+	if ((frame(m) && global(l)) || (global(m) && frame(l)))
+		return false;
+	return !(global(m) && global(l) && m->base != l->base);
+}
+
+// Loads in the first block (of params and outer scalars, see sync()), and
+// copies of args passed in registers, whose values are only needed past
+// the branch ending it move down into the one successor leading to every
+// use, so that the other path (an early exit) neither loads them nor holds
+// them in callee-saved registers, and the saves can be shrink-wrapped away
+// from it (see shrink_wrap()).
+void TranslateEnv::sink_entry_loads()
+{
+	Liveness lv;
+	lv.build(quads, labelid, tempid);
+	if (lv.nblock() < 2 || !lv.pred[0].empty() || !quads[lv.start[1]-1].isbranch())
+		return;
+	vector<unique_ptr<BB>> g = block_graph(lv, false);
+	DomTree dt;
+	dt.build(g);
+	// per temporary, the number of defs and the nearest block dominating
+	// its uses
+	vector<int> ndef(tempid), block(tempid, -1);
+	for (int b=0; b<lv.nblock(); b++) {
+		for (int i=lv.start[b]; i<lv.start[b+1]; i++) {
+			for_each_def(quads[i], [&](int id) {
+				if (id >= 0)
+					ndef[id]++;
+			});
+			for_each_use(quads[i], [&](int id) {
+				if (id < 0)
+					return;
+				int &d = block[id];
+				if (!dt.reachable(b))
+					d = 0;
+				else if (d < 0)
+					d = b;
+				else
+					while (!dt.dominates(d, b))
+						d = dt.idom[d];
+			});
+		}
+	}
+	int end = lv.start[1]; // of the first block
+	vector<vector<int>> sunk(2); // quads moving to each successor
+	for (int i=end-2; i>=0; i--) {
+		const Quad &q = quads[i];
+		if (q.op != Quad::MOV || !q.c->istemp())
+			continue;
+		bool reg = q.a->istemp() && astemp(q.a)->id < 0;
+		if (!q.a->ismem() && !reg)
+			continue;
+		int t = astemp(q.c)->id;
+		if (t < 0 || ndef[t] != 1 || block[t] < 1)
+			continue;
+		bool clobbered = false;
+		for (int j=i+1; j<end; j++) {
+			const Quad &r = quads[j];
+			if (reg) {
+				for_each_def(r, [&](int id) {
+					if (id == astemp(q.a)->id)
+						clobbered = true;
+				});
+			} else if (r.op == Quad::CALL ||
+				   (r.c && r.c->ismem() && r.op != Quad::PUSH && may_alias(asmem(r.c), asmem(q.a)))) {
+				clobbered = true;
+			}
+		}
+		if (clobbered)
+			continue;
+		for (int k=0; k<int(lv.succ[0].size()); k++) {
+			int s = lv.succ[0][k];
+			if (lv.pred[s].size() == 1 && dt.dominates(s, block[t])) {
+				sunk[k].push_back(i);
+				break;
+			}
+		}
+	}
+	if (sunk[0].empty() && sunk[1].empty())
+		return;
+	vector<char> moved(quads.size());
+	for (int k=0; k<2; k++)
+		for (int i: sunk[k])
+			moved[i] = true;
+	vector<Quad> out;
+	for (int b=0; b<lv.nblock(); b++) {
+		int i = lv.start[b];
+		while (i < lv.start[b+1] && quads[i].op == Quad::LABEL)
+			out.push_back(quads[i++]);
+		for (int k=0; k<int(lv.succ[0].size()); k++) {
+			if (lv.succ[0][k] != b)
+				continue;
+			for (auto it = sunk[k].rbegin(); it != sunk[k].rend(); it++)
+				out.push_back(quads[*it]);
+		}
+		for (; i<lv.start[b+1]; i++)
+			if (!moved[i])
+				out.push_back(quads[i]);
+	}
+	quads = move(out);
+}
+
+// Move the saves of the callee-saved registers in saved from the prologue
+// (before quad save_at) to the smallest region holding every use of them
+// that is entered and left once: a block S dominating the uses and a block
+// R post-dominating them, with S dominating R and R post-dominating S, so
+// that a path around the region (an early exit) saves nothing.  Neither
+// may be in a loop, or the registers would be saved on every iteration.
+// The restores go at the end of R (before quad restore_at).
+void TranslateEnv::shrink_wrap(unsigned char saved, int &save_at, int &restore_at)
+{
+	// the last block must fall into the epilogue
+	if (!saved || quads.back().isjump())
+		return;
+	for (const Quad &q: quads)
+		if (q.op == Quad::TAILJMP) // leaves from the middle
+			return;
+	Liveness lv;
+	lv.build(quads, labelid, tempid);
+	int n = lv.nblock();
+	// the reverse CFG is entered at a new exit block that the last one
+	// falls into
+	vector<unique_ptr<BB>> fwd = block_graph(lv, false), rev = block_graph(lv, true);
+	rev[0]->succ.push_back(rev[n].get());
+	rev[n]->pred.push_back(rev[0].get());
+	DomTree dt, pdt;
+	dt.build(fwd);
+	pdt.build(rev);
+	LoopNest ln;
+	ln.build(fwd, dt);
+	int S = -1, R = -1;
+	auto meet = [](const DomTree &t, int a, int b) {
+		while (!t.dominates(a, b))
+			a = t.idom[a];
+		return a;
+	};
+	for (int b=0; b<n; b++) {
+		// a block that never reaches the exit
+		if (dt.reachable(b) && !pdt.reachable(1+b))
+			return;
+		bool uses = false;
+		for (int i=lv.start[b]; i<lv.start[b+1]; i++) {
+			auto f = [&](int id) {
+				if (id < 0 && saved >> ~id & 1)
+					uses = true;
+			};
+			for_each_use(quads[i], f);
+			for_each_def(quads[i], f);
+		}
+		if (!uses || !dt.reachable(b))
+			continue;
+		S = S < 0 ? b : meet(dt, S, b);
+		R = R < 0 ? b : meet(pdt, 1+R, 1+b)-1;
+	}
+	for (;;) {
+		if (S == 0 || R < 0)
+			return;
+		if (!dt.dominates(S, R))
+			S = meet(dt, S, R);
+		else if (!pdt.dominates(1+R, 1+S))
+			R = meet(pdt, 1+R, 1+S)-1;
+		else if (ln.depth(S))
+			S = dt.idom[S];
+		else if (ln.depth(R))
+			R = pdt.idom[1+R]-1;
+		else
+			break;
+	}
+	int end = lv.start[R+1];
+	if (quads[end-1].is_jump_or_branch()) {
+		// restore before the jump, unless it compares a saved register
+		bool uses = false;
+		for_each_use(quads[end-1], [&](int id) {
+			if (id < 0 && saved >> ~id & 1)
+				uses = true;
+		});
+		if (uses)
+			return;
+		end--;
+	}
+	save_at = lv.start[S];
+	while (save_at < lv.start[S+1] && quads[save_at].op == Quad::LABEL)
+		save_at++;
+	restore_at = end;
+}
+
+void TranslateEnv::gencode()
+{
 	fprintf(outfp, "$%s:\n", procname.c_str());
 	// prologue
-	emit("push", ebp);
-	emit("mov", ebp, esp);
+	if (!fpo) {
+		emit("push", ebp);
+		emit("mov", ebp, esp);
+	}
 	if (framesize) {
 		ImmOperand fs(framesize);
 		emit("sub", esp, &fs);
 	}
-	if (maxphysreg >= 3) {
-		emit("push", ebx);
-		if (maxphysreg >= 6) {
-			emit("push", esi);
-			if (maxphysreg >= 7) {
-				emit("push", edi);
+	// Without a frame pointer, the bytes pushed so far (saved registers,
+	// args of a call) are added to the offsets off esp.  Labels are
+	// reached with the same depth from every side; where there is no
+	// fallthrough it is taken from a jump seen before, as a block comes
+	// after one of its predecessors (see linearize()).
+	int depth = 0;
+	// callee-saved: ebx, ebp (given out without a frame pointer), esi, edi
+	static TempOperand *const saved_reg[] = { ebx, ebp, esi, edi };
+	unsigned char saved = used_regs & 0xe8;
+	int save_at = 0, restore_at = quads.size();
+	if (opt->optimize)
+		shrink_wrap(saved, save_at, restore_at);
+	int nsaved = 0;
+	auto save = [&]() {
+		for (TempOperand *r: saved_reg) {
+			if (saved >> ~r->id & 1) {
+				emit("push", r);
+				nsaved++;
 			}
 		}
-	}
+		depth += 4*nsaved;
+	};
+	auto restore = [&]() {
+		for (int i=3; i>=0; i--) {
+			if (saved >> ~saved_reg[i]->id & 1)
+				emit("pop", saved_reg[i]);
+		}
+	};
+	auto leave = [&]() {
+		if (!fpo) {
+			emit("leave");
+		} else if (framesize) {
+			ImmOperand fs(framesize);
+			emit("add", esp, &fs);
+		}
+	};
+	unordered_map<Operand*, int> label_depth;
+	bool fallthrough = true;
+	auto shift = [&](Operand *o) {
+		if (!o || !o->ismem() || asmem(o)->base != esp)
+			return o;
+		MemOperand *m = asmem(o);
+		return static_cast<Operand*>(mem(m->size, esp, m->offset + framesize + depth,
+						 m->index, m->scale));
+	};
 	// body
-	for (const Quad &q: quads) {
+	for (int i=0; i<int(quads.size()); i++) {
+		if (i == save_at)
+			save();
+		if (i == restore_at) {
+			restore();
+			depth -= 4*nsaved;
+		}
+		Quad q = quads[i];
+		if (fpo) {
+			if (q.op == Quad::LABEL) {
+				auto it = label_depth.find(q.c);
+				if (!fallthrough && it != label_depth.end())
+					depth = it->second;
+				assert(it == label_depth.end() || it->second == depth);
+			} else if (q.op == Quad::JMP || q.isbranch()) {
+				label_depth[q.c] = depth;
+			}
+			q.c = shift(q.c);
+			q.a = shift(q.a);
+			q.b = shift(q.b);
+			if (q.op == Quad::PUSH)
+				depth += 4;
+			else if ((q.op == Quad::ADD || q.op == Quad::SUB) && q.c == esp) {
+				assert(q.a->isimm());
+				depth -= (q.op == Quad::ADD ? 1 : -1) * static_cast<ImmOperand*>(q.a)->val;
+			}
+		}
+		fallthrough = q.op != Quad::JMP && q.op != Quad::TAILJMP;
 		switch (q.op) {
 		case Quad::MOV:
-			if (!same_reg(q.c, q.a))
+			if (same_reg(q.c, q.a)) {
+				nmove_removed++;
+				break;
+			}
+			/* fallthrough */
 		case Quad::ADD:
 		case Quad::SUB:
 		case Quad::MULW:
 		case Quad::LEA:
 		case Quad::SEX:
+		case Quad::XOR:
+		case Quad::SHL:
+		case Quad::SAR:
+		case Quad::SHR:
 				emit(opins[q.op], q.c, q.a);
 			break;
 		case Quad::BEQ:
@@ -194,7 +569,10 @@ void TranslateEnv::gencode()
 		case Quad::BGE:
 		case Quad::BGT:
 		case Quad::BLE:
-			emit("cmp", q.a, q.b);
+			if (q.b)
+				emit("cmp", q.a, q.b);
+			else
+				emit("test", q.a, q.a);
 			/* fallthrough */
 		case Quad::DIVW:
 		case Quad::DIVB:
@@ -205,29 +583,34 @@ void TranslateEnv::gencode()
 		case Quad::INC:
 		case Quad::DEC:
 		case Quad::MULB:
+		case Quad::MULL:
 			emit(opins[q.op], q.c);
 			break;
 		case Quad::CDQ:
 		case Quad::CBW:
 			emit(opins[q.op]);
 			break;
+		case Quad::TAILJMP:
+			// the callee's args have replaced ours, see translate_tail_call()
+			restore();
+			leave();
+			emit(opins[q.op], q.c);
+			break;
 		case Quad::LABEL:
-			fprintf(outfp, "%s:\n", static_cast<LabelOperand*>(q.c)->label.c_str());
+			fprintf(outfp, "%s:\n", q.c->tostr().c_str());
 			break;
 		default:
 			assert(0);
 		}
 	}
 	// epilogue
-	if (maxphysreg >= 7)
-		emit("pop", edi);
-	if (maxphysreg >= 6)
-		emit("pop", esi);
-	if (maxphysreg >= 3)
-		emit("pop", ebx);
+	if (save_at == int(quads.size()))
+		save();
+	if (restore_at == int(quads.size()))
+		restore();
 	if (!up) /* main() should return 0 */
 		emit("xor", eax, eax);
-	emit("leave");
+	leave();
 	emit("ret");
 }
 
@@ -267,6 +650,8 @@ string TempOperand::tostr() const
 
 string LabelOperand::tostr() const
 {
+	if (id >= 0)
+		return ".l"+to_string(id);
 	return isalpha(label[0]) ? '$'+label : label;
 }
 
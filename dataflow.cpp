@@ -1,10 +1,14 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdio>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 #include "dynbitset.h"
 #include "translate.h"
@@ -12,9 +16,9 @@
 
 using namespace std;
 
-vector<unique_ptr<BB>> partition(const vector<Quad> &quads)
+vector<unique_ptr<BB>> partition(const vector<Quad> &quads, int nlabel)
 {
-	map<string, BB*> table;
+	vector<BB*> table(nlabel);
 	vector<unique_ptr<BB>> blocks;
 	int n = 0;
 	auto begin = quads.begin();
@@ -39,8 +43,7 @@ vector<unique_ptr<BB>> partition(const vector<Quad> &quads)
 		     it != bb->quads.end() && it->op == Quad::LABEL;
 		     it++)
 		{
-			const string &label = static_cast<LabelOperand*>(it->c)->label;
-			table[label] = bb.get();
+			table[static_cast<LabelOperand*>(it->c)->id] = bb.get();
 		}
 	}
 	// compute pred & succ
@@ -54,7 +57,7 @@ vector<unique_ptr<BB>> partition(const vector<Quad> &quads)
 			f->pred.push_back(bb.get());
 		}
 		if (lastq.is_jump_or_branch()) {
-			BB *t = table[static_cast<LabelOperand*>(lastq.c)->label];
+			BB *t = table[static_cast<LabelOperand*>(lastq.c)->id];
 			bb->succ.push_back(t);
 			t->pred.push_back(bb.get());
 		}
@@ -98,13 +101,11 @@ void split_edges(vector<unique_ptr<BB>> &blocks)
 	move(newblocks.begin(), newblocks.end(), inserter(blocks, blocks.end()));
 }
 
-void compute_def(const Quad &q, dynbitset &ret)
+void for_each_def(const Quad &q, function<void(int)> f)
 {
 	auto def = [&](Operand *o) {
-		if (o->istemp()) {
-			int id = astemp(o)->id;
-			ret.set(8+id);
-		}
+		if (o->istemp())
+			f(astemp(o)->id);
 	};
 	switch (q.op) {
 	case Quad::DIVW:
@@ -117,6 +118,10 @@ void compute_def(const Quad &q, dynbitset &ret)
 	case Quad::ADD:
 	case Quad::SUB:
 	case Quad::MULW:
+	case Quad::XOR:
+	case Quad::SHL:
+	case Quad::SAR:
+	case Quad::SHR:
 	case Quad::NEG:
 	case Quad::MOV:
 	case Quad::LEA:
@@ -138,6 +143,7 @@ void compute_def(const Quad &q, dynbitset &ret)
 	case Quad::BGT:
 	case Quad::BLE:
 	case Quad::JMP:
+	case Quad::TAILJMP:
 	case Quad::PUSH:
 	case Quad::LABEL:
 	case Quad::SYNCM:
@@ -157,6 +163,10 @@ void compute_def(const Quad &q, dynbitset &ret)
 	case Quad::MULB:
 		def(eax);
 		break;
+	case Quad::MULL:
+		def(eax);
+		def(edx);
+		break;
 	default:
 		assert(0);
 	}
@@ -169,6 +179,10 @@ int compute_def_temp(const Quad &q)
 	case Quad::ADD:
 	case Quad::SUB:
 	case Quad::MULW:
+	case Quad::XOR:
+	case Quad::SHL:
+	case Quad::SAR:
+	case Quad::SHR:
 	case Quad::NEG:
 	case Quad::MOV:
 	case Quad::LEA:
@@ -197,11 +211,13 @@ int compute_def_temp(const Quad &q)
 	case Quad::BGT:
 	case Quad::BLE:
 	case Quad::JMP:
+	case Quad::TAILJMP:
 	case Quad::CALL:
 	case Quad::PUSH:
 	case Quad::CDQ:
 	case Quad::CBW:
 	case Quad::MULB:
+	case Quad::MULL:
 	case Quad::LABEL:
 	case Quad::SYNCM:
 	case Quad::SYNCR:
@@ -234,6 +250,10 @@ void for_each_use(const Quad &q, function<void(int)> f)
 	case Quad::ADD:
 	case Quad::SUB:
 	case Quad::MULW:
+	case Quad::XOR:
+	case Quad::SHL:
+	case Quad::SAR:
+	case Quad::SHR:
 		use_operand(q.c, f);
 		use_operand(q.a, f);
 		break;
@@ -265,10 +285,20 @@ void for_each_use(const Quad &q, function<void(int)> f)
 	case Quad::MUL3:
 	case Quad::DIV3:
 		use_operand(q.a, f);
-		use_operand(q.b, f);
+		if (q.b)
+			use_operand(q.b, f);
 		break;
-	case Quad::JMP:
+	case Quad::TAILJMP:
 	case Quad::CALL:
+		// the args passed in registers
+		if (q.a) {
+			int regs = static_cast<ImmOperand*>(q.a)->val;
+			for (int r=0; r<8; r++)
+				if (regs >> r & 1)
+					f(~r);
+		}
+		break;
+	case Quad::JMP:
 	case Quad::LABEL:
 	case Quad::SYNCM:
 	case Quad::SYNCR:
@@ -284,6 +314,7 @@ void for_each_use(const Quad &q, function<void(int)> f)
 		use_operand(eax, f);
 		break;
 	case Quad::MULB:
+	case Quad::MULL:
 		use_operand(eax, f);
 		use_operand(q.c, f);
 		break;
@@ -296,11 +327,32 @@ void Graph::connect(int a, int b)
 {
 	assert(a >= -8 && a < end);
 	assert(b >= -8 && b < end);
-	vector<int> &na = neighbors(a);
-	if (find(na.begin(), na.end(), b) == na.end()) {
-		na.push_back(b);
-		neighbors(b).push_back(a);
+	if (a == b || interferes(a, b))
+		return;
+	int ra = getrow(a);
+	int rb = getrow(b);
+	if (ra < rb)
+		swap(ra, rb);
+	if (ra < matrix_rows)
+		matrix.set(index(ra, rb));
+	else
+		big.insert(uint64_t(ra) << 32 | rb);
+	_neighbors[8+a].push_back(b);
+	_neighbors[8+b].push_back(a);
+	_degree[8+a]++;
+	_degree[8+b]++;
+}
+
+int Graph::getrow(int v)
+{
+	int &r = row[8+v];
+	if (r < 0) {
+		// the new row r holds the bits for rows 0..r-1
+		r = nrow++;
+		if (nrow <= matrix_rows)
+			matrix.resize(index(nrow, 0));
 	}
+	return r;
 }
 
 void printtemp(int t)
@@ -325,69 +377,331 @@ void Graph::print() const
 	}
 }
 
-vector<int> Graph::remove(int v)
+void Graph::remove(int v)
 {
 	assert(v >= -8 && v < end);
+	assert(!removed(v));
+	_removed[8+v] = true;
 	for (int a: neighbors(v)) {
-		vector<int> &na = neighbors(a);
-		na.erase(find(na.begin(), na.end(), v));
+		if (!removed(a))
+			_degree[8+a]--;
 	}
-	vector<int> &nv = neighbors(v);
-	vector<int> ret(move(nv));
-	nv.clear();
-	return ret;
 }
 
-Graph TranslateEnv::build_interference_graph()
+void DomTree::build(const vector<unique_ptr<BB>> &blocks)
 {
-	size_t n = quads.size();
-	map<string, int> labelmap;
-	vector<dynbitset> def(n, dynbitset(8+tempid));
-	vector<dynbitset> use(n, dynbitset(8+tempid));
-	vector<dynbitset> out(n, dynbitset(8+tempid));
-	vector<dynbitset> in (n, dynbitset(8+tempid));
-	vector<vector<int>> succ(n);
-	for (size_t i=0; i<n; i++) {
-		const Quad &q = quads[i];
-		if (q.op == Quad::LABEL) {
-			labelmap[static_cast<LabelOperand*>(q.c)->label] = i;
+	int n = blocks.size();
+	// number the blocks in postorder by an iterative depth-first search
+	vector<int> po(n, -1);
+	rpo.clear();
+	vector<pair<int,size_t>> dfs;
+	vector<bool> visited(n);
+	visited[0] = true;
+	dfs.emplace_back(0, 0);
+	while (!dfs.empty()) {
+		int b = dfs.back().first;
+		size_t &i = dfs.back().second;
+		const vector<BB*> &succ = blocks[b]->succ;
+		if (i < succ.size()) {
+			int s = succ[i++]->id;
+			if (!visited[s]) {
+				visited[s] = true;
+				dfs.emplace_back(s, 0);
+			}
 		} else {
-			compute_def(q, def[i]);
-			for_each_use(q, [&](int id){use[i].set(8+id);});
+			po[b] = rpo.size();
+			rpo.push_back(b);
+			dfs.pop_back();
+		}
+	}
+	reverse(rpo.begin(), rpo.end());
+	idom.assign(n, -1);
+	idom[0] = 0;
+	auto intersect = [&](int a, int b) {
+		while (a != b) {
+			while (po[a] < po[b])
+				a = idom[a];
+			while (po[b] < po[a])
+				b = idom[b];
+		}
+		return a;
+	};
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (int b: rpo) {
+			if (b == 0)
+				continue;
+			int d = -1;
+			for (const BB *p: blocks[b]->pred) {
+				if (idom[p->id] < 0)
+					continue;
+				d = d < 0 ? p->id : intersect(p->id, d);
+			}
+			if (idom[b] != d) {
+				idom[b] = d;
+				changed = true;
+			}
 		}
 	}
-	for (size_t i=0; i<n; i++) {
+	children.assign(n, vector<int>());
+	for (int b: rpo) {
+		if (b != 0)
+			children[idom[b]].push_back(b);
+	}
+	// a join point is in the frontier of every block on the tree paths from
+	// its predecessors up to (not including) its idom
+	df.assign(n, vector<int>());
+	for (int b: rpo) {
+		if (blocks[b]->pred.size() < 2)
+			continue;
+		for (const BB *p: blocks[b]->pred) {
+			if (idom[p->id] < 0)
+				continue;
+			// the entry may be a loop header itself
+			int stop = b == 0 ? -1 : idom[b];
+			for (int r = p->id; r != stop; r = r == 0 ? -1 : idom[r]) {
+				if (!df[r].empty() && df[r].back() == b)
+					break;
+				df[r].push_back(b);
+			}
+		}
+	}
+	pre.assign(n, -1);
+	post.assign(n, -1);
+	int clock = 0;
+	vector<pair<int,size_t>> walk;
+	walk.emplace_back(0, 0);
+	pre[0] = clock++;
+	while (!walk.empty()) {
+		int b = walk.back().first;
+		size_t &i = walk.back().second;
+		if (i < children[b].size()) {
+			int c = children[b][i++];
+			pre[c] = clock++;
+			walk.emplace_back(c, 0);
+		} else {
+			post[b] = clock++;
+			walk.pop_back();
+		}
+	}
+}
+
+void LoopNest::build(const vector<unique_ptr<BB>> &blocks, const DomTree &dt)
+{
+	int n = blocks.size();
+	loops.clear();
+	// an edge b->h is a back edge iff h dominates b; the loop of h is h
+	// and every block reaching such a b without passing through h
+	for (int h: dt.rpo) {
+		vector<int> work;
+		for (const BB *p: blocks[h]->pred) {
+			if (dt.reachable(p->id) && dt.dominates(h, p->id))
+				work.push_back(p->id);
+		}
+		if (work.empty())
+			continue;
+		Loop l;
+		l.header = h;
+		l.parent = -1;
+		l.depth = 1;
+		l.member.assign(n, false);
+		l.member[h] = true;
+		l.blocks.push_back(h);
+		while (!work.empty()) {
+			int b = work.back();
+			work.pop_back();
+			if (l.member[b])
+				continue;
+			l.member[b] = true;
+			l.blocks.push_back(b);
+			for (const BB *p: blocks[b]->pred) {
+				if (dt.reachable(p->id) && !l.member[p->id])
+					work.push_back(p->id);
+			}
+		}
+		loops.push_back(move(l));
+	}
+	stable_sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+		return a.blocks.size() < b.blocks.size();
+	});
+	// two natural loops are either disjoint or nested, so the smallest
+	// loop containing another's header encloses it
+	int m = loops.size();
+	for (int i=0; i<m; i++) {
+		for (int j=i+1; j<m; j++) {
+			if (loops[j].contains(loops[i].header)) {
+				loops[i].parent = j;
+				break;
+			}
+		}
+	}
+	for (int i=m-1; i>=0; i--) {
+		if (loops[i].parent >= 0)
+			loops[i].depth = loops[loops[i].parent].depth+1;
+	}
+	innermost.assign(n, -1);
+	for (int i=m-1; i>=0; i--) {
+		for (int b: loops[i].blocks)
+			innermost[b] = i;
+	}
+}
+
+void Liveness::build(const vector<Quad> &quads, int nlabel, int ntemp)
+{
+	int n = quads.size();
+	vector<int> label_block(nlabel, -1);
+	start.clear();
+	for (int i=0; i<n; i++) {
 		const Quad &q = quads[i];
-		if (q.is_jump_or_branch())
-			succ[i].push_back(labelmap[static_cast<LabelOperand*>(q.c)->label]);
-		if (!q.isjump() && i != n-1)
-			succ[i].push_back(i+1);
+		// a block begins at the first of a run of labels, and after a jump or branch
+		if (i == 0 ||
+		    (q.op == Quad::LABEL && quads[i-1].op != Quad::LABEL) ||
+		    quads[i-1].is_jump_or_branch())
+			start.push_back(i);
+		if (q.op == Quad::LABEL)
+			label_block[static_cast<LabelOperand*>(q.c)->id] = start.size()-1;
 	}
-	bool changed;
-	do {
-		changed = false;
-		for (size_t j=n; j; j--) {
-			size_t i = j-1;
-			in[i] = use[i] | (out[i]-def[i]);
+	int nb = start.size();
+	start.push_back(n);
+	succ.assign(nb, vector<int>());
+	pred.assign(nb, vector<int>());
+	use.assign(nb, dynbitset(8+ntemp));
+	def.assign(nb, dynbitset(8+ntemp));
+	in .assign(nb, dynbitset(8+ntemp));
+	out.assign(nb, dynbitset(8+ntemp));
+	for (int b=0; b<nb; b++) {
+		const Quad &last = quads[start[b+1]-1];
+		if (last.is_jump_or_branch()) {
+			int t = label_block[static_cast<LabelOperand*>(last.c)->id];
+			assert(t >= 0);
+			succ[b].push_back(t);
+		}
+		if (!last.isjump() && b+1 < nb)
+			succ[b].push_back(b+1);
+		for (int s: succ[b])
+			pred[s].push_back(b);
+		dynbitset &u = use[b], &d = def[b];
+		for (int i=start[b]; i<start[b+1]; i++) {
+			// upward exposed uses
+			for_each_use(quads[i], [&](int id) {
+				if (!d.get(8+id))
+					u.set(8+id);
+			});
+			for_each_def(quads[i], [&](int id) {
+				d.set(8+id);
+			});
 		}
-		for (size_t i=0; i<n; i++) {
-			for (int s: succ[i]) {
-				if (out[i].add_all(in[s]))
-					changed = true;
+	}
+}
+
+void Liveness::solve()
+{
+	int nb = nblock();
+	if (!nb)
+		return;
+	// visit blocks in postorder first, so that most successors are done
+	// before their predecessors
+	vector<int> order;
+	vector<bool> visited(nb);
+	vector<pair<int, size_t>> stack;
+	stack.emplace_back(0, 0);
+	visited[0] = true;
+	while (!stack.empty()) {
+		int b = stack.back().first;
+		size_t &k = stack.back().second;
+		if (k < succ[b].size()) {
+			int s = succ[b][k++];
+			if (!visited[s]) {
+				visited[s] = true;
+				stack.emplace_back(s, 0);
 			}
+		} else {
+			order.push_back(b);
+			stack.pop_back();
 		}
-	} while (changed);
-	Graph ig(tempid);
-	for (size_t i=0; i<n; i++) {
-		def[i].foreach([&](int tdef) {
-			out[i].foreach([&](int tlive) {
-				if (tdef != tlive) {
-					ig.connect(tdef-8, tlive-8);
+	}
+	for (int b=0; b<nb; b++)
+		if (!visited[b])
+			order.push_back(b);
+	deque<int> worklist(order.begin(), order.end());
+	vector<bool> queued(nb, true);
+	while (!worklist.empty()) {
+		int b = worklist.front();
+		worklist.pop_front();
+		queued[b] = false;
+		for (int s: succ[b])
+			out[b] |= in[s];
+		if (in[b].update(use[b] | (out[b]-def[b]))) {
+			for (int p: pred[b]) {
+				if (!queued[p]) {
+					queued[p] = true;
+					worklist.push_back(p);
 				}
+			}
+		}
+	}
+}
+
+// Carry the boundary sets over to the next round of register allocation.
+// Spilled temporaries have been replaced by memory, and rewrite() has moved
+// quad i to newpos[i].  The reload temporaries created since never live
+// across blocks, so in and out stay exact without solving again; use and
+// def are dropped.
+void Liveness::update(const vector<int> &newpos, const vector<int> &color, int ntemp)
+{
+	for (int &s: start)
+		s = newpos[s];
+	auto drop_spilled = [&](dynbitset &s) {
+		dynbitset t(8+ntemp);
+		s.foreach([&](int i) {
+			if (i < 8 || color[i-8] >= 0)
+				t.set(i);
+		});
+		s = move(t);
+	};
+	for (dynbitset &s: in)
+		drop_spilled(s);
+	for (dynbitset &s: out)
+		drop_spilled(s);
+	use.clear();
+	def.clear();
+}
+
+// walk block b backwards, deriving the live set after each quad
+static void interfere_block(Graph &ig, const vector<Quad> &quads, const Liveness &lv, int b)
+{
+	vector<int> defs;
+	dynbitset live(lv.out[b]);
+	for (int i=lv.start[b+1]-1; i>=lv.start[b]; i--) {
+		const Quad &q = quads[i];
+		defs.clear();
+		for_each_def(q, [&](int id) {
+			defs.push_back(id);
+		});
+		// the source of a move need not interfere with its destination,
+		// so that the two can be coalesced
+		int src = -9;
+		if (q.op == Quad::MOV && q.a->istemp())
+			src = astemp(q.a)->id;
+		for (int tdef: defs) {
+			live.foreach([&](int tlive) {
+				if (8+tdef != tlive && 8+src != tlive)
+					ig.connect(tdef, tlive-8);
 			});
+		}
+		for (int tdef: defs)
+			live.clear(8+tdef);
+		for_each_use(q, [&](int id) {
+			live.set(8+id);
 		});
 	}
+}
+
+static void interfere_part_temps(Graph &ig, const vector<int> &part_temps, int first)
+{
 	for (int id: part_temps) {
+		if (id < first)
+			continue;
 #ifdef DEBUG
 		fprintf(stderr, "part temp: %d\n", id);
 #endif
@@ -396,14 +710,143 @@ Graph TranslateEnv::build_interference_graph()
 		ig.connect(id, ~6);
 		ig.connect(id, ~7);
 	}
+}
+
+Graph TranslateEnv::build_interference_graph(Liveness &lv)
+{
+	lv.build(quads, labelid, tempid);
+	lv.solve();
+	Graph ig(tempid);
+	for (int b=0; b<lv.nblock(); b++)
+		interfere_block(ig, quads, lv, b);
+	interfere_part_temps(ig, part_temps, 0);
 	return ig;
 }
 
-void replace_def(Quad &q, int old, int neu)
+// Graph for a later round of regalloc(), from the graph and the liveness
+// of the last one (see Liveness::update()) instead of solving again.  The
+// temporaries left keep their edges; only the blocks defining the reloads
+// made since (numbered from last.ntemp()) are walked for theirs.
+Graph TranslateEnv::update_interference_graph(Liveness &lv, const vector<int> &newpos, const vector<int> &color, const Graph &last)
 {
-	auto replace = [=](Operand *&o) {
+	lv.update(newpos, color, tempid);
+	int first_new = last.ntemp();
+	Graph ig(tempid);
+	for (int v=-8; v<first_new; v++) {
+		if (v >= 0 && color[v] < 0)
+			continue;
+		for (int w: last.neighbors(v)) {
+			if (w < v && (w < 0 || color[w] >= 0))
+				ig.connect(v, w);
+		}
+	}
+	for (int b=0; b<lv.nblock(); b++) {
+		bool fresh = false;
+		for (int i=lv.start[b]; i<lv.start[b+1] && !fresh; i++) {
+			for_each_def(quads[i], [&](int id) {
+				if (id >= first_new)
+					fresh = true;
+			});
+		}
+		if (fresh)
+			interfere_block(ig, quads, lv, b);
+	}
+	interfere_part_temps(ig, part_temps, first_new);
+	return ig;
+}
+
+// Estimated cost of spilling each temporary: every def and use weighs
+// 10^depth, where depth is the number of loops around it.  A loop is the
+// range between a label and a backward jump or branch to it.  Moves between
+// a scalar and its home location are free, as a spilled scalar lives there.
+// A temporary only moved from or to a register, or pushed, such as the
+// static link or an argument, is marked in free_spill once there is a
+// frame: its slot then takes the place of the register in those quads,
+// which costs a memory access but no extra quad, so it weighs a quarter
+// (see color_graph()).
+vector<float> TranslateEnv::spill_costs(vector<char> &free_spill)
+{
+	int n = quads.size();
+	vector<int> label_pos(labelid, -1);
+	vector<int> nest(n+1); // difference array of loop depth
+	for (int i=0; i<n; i++) {
+		const Quad &q = quads[i];
+		if (q.op == Quad::LABEL) {
+			int id = static_cast<LabelOperand*>(q.c)->id;
+			if (id >= 0)
+				label_pos[id] = i;
+		} else if (q.is_jump_or_branch()) {
+			int id = static_cast<LabelOperand*>(q.c)->id;
+			if (id >= 0 && label_pos[id] >= 0) {
+				nest[label_pos[id]]++;
+				nest[i+1]--;
+			}
+		}
+	}
+	auto is_home = [&](Operand *t, Operand *m) {
+		return t->istemp() && astemp(t)->id >= 0 && astemp(t)->id < scalar_id &&
+			m == translate_varsym(scalar_var[astemp(t)->id]);
+	};
+	vector<float> cost(tempid);
+	free_spill.assign(tempid, framesize || !fpo);
+	auto isreg = [](Operand *o) {
+		return o->istemp() && astemp(o)->id < 0;
+	};
+	int depth = 0;
+	for (int i=0; i<n; i++) {
+		depth += nest[i];
+		const Quad &q = quads[i];
+		if (q.op == Quad::MOV && (is_home(q.c, q.a) || is_home(q.a, q.c)))
+			continue;
+		float w = 1;
+		for (int d=0; d<depth && d<8; d++)
+			w *= 10;
+		auto add = [&](int id) {
+			if (id >= 0)
+				cost[id] += w;
+		};
+		for_each_def(q, add);
+		for_each_use(q, add);
+		Operand *direct = q.op == Quad::PUSH ? q.c :
+			q.op != Quad::MOV ? nullptr :
+			isreg(q.a) ? q.c : isreg(q.c) ? q.a : nullptr;
+		auto busy = [&](int id) {
+			if (id >= 0 && !(direct && direct->istemp() && astemp(direct)->id == id))
+				free_spill[id] = false;
+		};
+		for_each_def(q, busy);
+		for_each_use(q, busy);
+	}
+	for (int i=0; i<tempid; i++) {
+		if (i < scalar_id)
+			free_spill[i] = false;
+		else if (free_spill[i])
+			cost[i] /= 4;
+	}
+	return cost;
+}
+
+// register-to-register moves, as (destination, source) pairs
+vector<pair<int,int>> TranslateEnv::collect_moves() const
+{
+	vector<pair<int,int>> moves;
+	for (const Quad &q: quads) {
+		if (q.op == Quad::MOV && q.c->istemp() && q.a->istemp() &&
+		    q.c->size == q.a->size) {
+			int c = astemp(q.c)->id;
+			int a = astemp(q.a)->id;
+			if (c >= 0 || a >= 0)
+				moves.emplace_back(c, a);
+		}
+	}
+	return moves;
+}
+
+void replace_def(Quad &q, int old, int neu, TranslateEnv &env)
+{
+	auto replace = [&](Operand *&o) {
 		if (o->istemp() && astemp(o)->id == old)
-			o = new TempOperand(o->size, neu);
+			o = env.temp(o->size, neu);
 	};
 	switch (q.op) {
 	case Quad::ADD3:
@@ -426,6 +869,7 @@ void replace_def(Quad &q, int old, int neu)
 	case Quad::BGT:
 	case Quad::BLE:
 	case Quad::JMP:
+	case Quad::TAILJMP:
 	case Quad::PUSH:
 	case Quad::LABEL:
 	case Quad::CALL:
@@ -437,33 +881,39 @@ void replace_def(Quad &q, int old, int neu)
 	}
 }
 
-void replace_temp(Operand *&o, int old, int neu)
+void replace_temp(Operand *&o, int old, int neu, TranslateEnv &env)
 {
 	assert(o->istemp());
 	if (astemp(o)->id == old)
-		o = new TempOperand(o->size, neu);
+		o = env.temp(o->size, neu);
 }
 
-void replace(Operand *&o, int old, int neu);
+void replace(Operand *&o, int old, int neu, TranslateEnv &env);
 
-void replace_mem(MemOperand *m, int old, int neu)
+void replace_mem(Operand *&o, int old, int neu, TranslateEnv &env)
 {
-	if (m->base)
-		replace(m->base, old, neu);
-	if (m->index)
-		replace(m->index, old, neu);
+	// operands are shared, so build a new one instead of modifying o
+	MemOperand *m = asmem(o);
+	Operand *base = m->base;
+	Operand *index = m->index;
+	if (base)
+		replace(base, old, neu, env);
+	if (index)
+		replace(index, old, neu, env);
+	if (base != m->base || index != m->index)
+		o = env.mem(m->size, base, m->offset, index, m->scale);
 }
 
-void replace(Operand *&o, int old, int neu)
+void replace(Operand *&o, int old, int neu, TranslateEnv &env)
 {
 	if (o->istemp()) {
-		replace_temp(o, old, neu);
+		replace_temp(o, old, neu, env);
 	} else if (o->ismem()) {
-		replace_mem(static_cast<MemOperand*>(o), old, neu);
+		replace_mem(o, old, neu, env);
 	}
 }
 
-void replace_use(Quad &q, int old, int neu)
+void replace_use(Quad &q, int old, int neu, TranslateEnv &env)
 {
 	switch (q.op) {
 	case Quad::NEG2:
@@ -471,8 +921,8 @@ void replace_use(Quad &q, int old, int neu)
 	case Quad::LEA:
 	case Quad::SEX:
 		if (q.c->ismem())
-			replace_mem(static_cast<MemOperand*>(q.c), old, neu);
-		replace(q.a, old, neu);
+			replace_mem(q.c, old, neu, env);
+		replace(q.a, old, neu, env);
 		break;
 	case Quad::BEQ:
 	case Quad::BNE:
@@ -480,22 +930,23 @@ void replace_use(Quad &q, int old, int neu)
 	case Quad::BGE:
 	case Quad::BGT:
 	case Quad::BLE:
-		replace(q.a, old, neu);
-		replace(q.b, old, neu);
+		replace(q.a, old, neu, env);
+		replace(q.b, old, neu, env);
 		break;
 	case Quad::ADD3:
 	case Quad::SUB3:
 	case Quad::MUL3:
 	case Quad::DIV3:
 		if (q.c->ismem())
-			replace_mem(static_cast<MemOperand*>(q.c), old, neu);
-		replace(q.a, old, neu);
-		replace(q.b, old, neu);
+			replace_mem(q.c, old, neu, env);
+		replace(q.a, old, neu, env);
+		replace(q.b, old, neu, env);
 		break;
 	case Quad::PUSH:
-		replace(q.c, old, neu);
+		replace(q.c, old, neu, env);
 		break;
 	case Quad::JMP:
+	case Quad::TAILJMP:
 	case Quad::CALL:
 	case Quad::LABEL:
 		break;
@@ -1,3 +1,14 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "dynbitset.h"
+#include "translate.h"
+
 struct BB {
 	std::vector<Quad> quads;
 	std::vector<BB*> pred, succ;
@@ -5,38 +16,127 @@ struct BB {
 	BB(int id): id(id) {}
 };
 
+// Dominator tree of a CFG entered at blocks[0], by the iterative algorithm
+// of Cooper, Harvey and Kennedy.  Unreachable blocks have idom -1 and are
+// not in the tree.
+struct DomTree {
+	std::vector<int> idom; // the entry is its own idom
+	std::vector<std::vector<int>> children;
+	std::vector<std::vector<int>> df; // dominance frontier
+	std::vector<int> rpo; // reachable blocks in reverse postorder
+	std::vector<int> pre, post; // numbering of a walk of the tree
+	void build(const std::vector<std::unique_ptr<BB>> &blocks);
+	bool reachable(int b) const { return idom[b] >= 0; }
+	bool dominates(int a, int b) const
+	{
+		return pre[a] <= pre[b] && post[b] <= post[a];
+	}
+};
+
+// Natural loops of a CFG, found from the back edges of its dominator tree.
+// Loops sharing a header are merged.  loops is sorted by size, so an inner
+// loop comes before the loops enclosing it.
+struct Loop {
+	int header;
+	int parent; // index of the innermost enclosing loop, or -1
+	int depth; // 1 for an outermost loop
+	std::vector<int> blocks; // including the header and inner loops
+	std::vector<char> member; // indexed by block
+	bool contains(int b) const { return member[b]; }
+};
+
+struct LoopNest {
+	std::vector<Loop> loops;
+	std::vector<int> innermost; // per block, index of a loop or -1
+	void build(const std::vector<std::unique_ptr<BB>> &blocks, const DomTree &dt);
+	int depth(int b) const { return innermost[b] < 0 ? 0 : loops[innermost[b]].depth; }
+};
+
+// Live temporaries at the boundaries of the basic blocks of a linear quad
+// list; bit 8+id stands for temporary id, so physical registers are included.
+// Block b consists of quads [start[b], start[b+1]).
+struct Liveness {
+	std::vector<int> start;
+	std::vector<std::vector<int>> succ, pred;
+	std::vector<dynbitset> use, def, in, out;
+	void build(const std::vector<Quad> &quads, int nlabel, int ntemp);
+	void solve();
+	void update(const std::vector<int> &newpos, const std::vector<int> &color, int ntemp);
+	int nblock() const { return int(start.size())-1; }
+};
+
+// Interference graph over temporaries -8..end-1; negative ones are the
+// physical registers.  Every edge is kept twice: in a triangular bit matrix
+// for constant-time membership tests, and in the adjacency lists for
+// iteration.  remove() leaves the lists alone; it only marks the node and
+// decrements the degree of its neighbors.
+// Only the nodes that have edges get a row in the matrix, numbered in the
+// order they first appear, so temporaries that are no longer referenced
+// cost nothing.  Edges to rows past matrix_rows go to a hash set instead,
+// which keeps the matrix small on huge procedures.
 class Graph
 {
 	std::vector<std::vector<int>> _neighbors;
+	std::vector<int> _degree;
+	std::vector<bool> _removed;
+	std::vector<int> row; // -1 if the node has no edges
+	static const int matrix_rows = 8192;
+	int nrow = 0;
+	dynbitset matrix;
+	std::unordered_set<uint64_t> big; // edges (a,b) with a >= matrix_rows
 	int end;
-public:
-	Graph(int end): _neighbors(8+end), end(end) {}
-	std::vector<int> &neighbors(int v)
+	static size_t index(int a, int b)
 	{
-		return _neighbors[8+v];
+		// a > b >= 0 are rows
+		return size_t(a)*(a-1)/2+b;
 	}
+	int getrow(int v);
+public:
+	Graph(int end): _neighbors(8+end), _degree(8+end), _removed(8+end),
+			row(8+end, -1), end(end) {}
+	// includes removed nodes
 	const std::vector<int> &neighbors(int v) const
 	{
 		return _neighbors[8+v];
 	}
 	int ntemp() const { return end; }
+	bool interferes(int a, int b) const
+	{
+		a = row[8+a];
+		b = row[8+b];
+		if (a < 0 || b < 0 || a == b)
+			return false;
+		if (a < b)
+			std::swap(a, b);
+		if (a < matrix_rows)
+			return matrix.get(index(a, b));
+		return big.count(uint64_t(a) << 32 | b);
+	}
 	void connect(int a, int b);
-	std::vector<int> remove(int v);
+	void remove(int v);
+	bool removed(int v) const
+	{
+		return _removed[8+v];
+	}
 	void print() const;
+	// number of neighbors not yet removed
 	int degree(int v) const
 	{
-		return neighbors(v).size();
+		return _degree[8+v];
 	}
 };
 
-std::vector<std::unique_ptr<BB>> partition(const std::vector<Quad> &quads);
-std::vector<int> color_graph(Graph &&g);
+std::vector<std::unique_ptr<BB>> partition(const std::vector<Quad> &quads, int nlabel);
+std::vector<int> color_graph(Graph &&g, const std::vector<float> &cost,
+			     const std::vector<std::pair<int,int>> &moves,
+			     unsigned char regs,
+			     const std::vector<char> *free_spill = nullptr);
 bool blocks_to_dot(const std::vector<std::unique_ptr<BB>> &blocks,
 		   const char *fpath);
-void compute_def(const Quad &q, dynbitset &ret);
+void for_each_def(const Quad &q, std::function<void(int)> f);
 void for_each_use(const Quad &q, std::function<void(int)> f);
 int compute_def_temp(const Quad &q);
-void replace_def(Quad &q, int old, int neu);
-void replace_use(Quad &q, int old, int neu);
+void replace_def(Quad &q, int old, int neu, TranslateEnv &env);
+void replace_use(Quad &q, int old, int neu, TranslateEnv &env);
 void split_edges(std::vector<std::unique_ptr<BB>> &blocks);
 void dump_cfg(const std::string &procname, const std::vector<std::unique_ptr<BB>> &blocks);
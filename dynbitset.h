@@ -1,3 +1,11 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
 constexpr size_t log2_r(size_t n, size_t a)
 {
         return n == 1 ? a : log2_r(n>>1, a+1);
@@ -115,9 +123,12 @@ public:
 	}
 	void foreach(std::function<void(int)> f) const
 	{
-		for (size_t i=0; i<_size; i++)
-			if (get(i))
-				f(i);
+		size_t n = data.size();
+		for (size_t i=0; i<n; i++) {
+			// skip empty words
+			for (word w = data[i]; w; w &= w-1)
+				f(i<<lwsize | __builtin_ctzl(w));
+		}
 	}
 	std::string tostr() const
 	{
@@ -143,10 +154,10 @@ public:
 	}
 	int first() const
 	{
-		int n = _size;
+		int n = data.size();
 		for (int i=0; i<n; i++)
-			if (get(i))
-				return i;
+			if (data[i])
+				return i<<lwsize | __builtin_ctzl(data[i]);
 		return -1;
 	}
 	std::vector<int> to_vector() const
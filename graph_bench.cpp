@@ -0,0 +1,86 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+#include "translate.h"
+#include "dynbitset.h"
+#include "dataflow.h"
+
+using namespace std;
+
+// Microbenchmark for the interference graph: random graphs of n temporaries
+// where each one interferes with about d others, a few of them also with the
+// physical registers.
+
+static double since(chrono::steady_clock::time_point t0)
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now()-t0).count();
+}
+
+static void bench(int n, int d, unsigned seed)
+{
+	mt19937 rng(seed);
+	vector<pair<int,int>> edges;
+	size_t m = size_t(n)*d/2;
+	edges.reserve(m+n/8);
+	for (size_t i=0; i<m; i++) {
+		int a = rng()%n;
+		int b = rng()%n;
+		if (a != b)
+			edges.emplace_back(a, b);
+	}
+	for (int i=0; i<n; i+=8)
+		edges.emplace_back(i, ~int(rng()%8));
+
+	auto t0 = chrono::steady_clock::now();
+	Graph g(n);
+	for (auto &e: edges)
+		g.connect(e.first, e.second);
+	// every edge again, as liveness walks insert most of them more than once
+	for (auto &e: edges)
+		g.connect(e.second, e.first);
+	double t_build = since(t0);
+
+	t0 = chrono::steady_clock::now();
+	size_t hits = 0;
+	for (auto &e: edges)
+		hits += g.interferes(e.first, e.second);
+	for (int i=0; i<n; i++)
+		hits += g.degree(i);
+	double t_query = since(t0);
+	assert(hits >= edges.size());
+
+	vector<float> cost(n);
+	for (int i=0; i<n; i++)
+		cost[i] = 1+rng()%100;
+	t0 = chrono::steady_clock::now();
+	vector<int> color = color_graph(move(g), cost, {}, 0xcf);
+	double t_color = since(t0);
+	int spilled = 0;
+	for (int c: color)
+		spilled += c < 0;
+
+	printf("n=%-6d d=%-4d edges=%-8zu build %8.2fms  query %8.2fms  color %9.2fms  spilled %d\n",
+	       n, d, edges.size(), t_build, t_query, t_color, spilled);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3) {
+		bench(atoi(argv[1]), atoi(argv[2]), 1);
+		return 0;
+	}
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s [<nodes> <degree>]\n", argv[0]);
+		return 2;
+	}
+	bench(10000, 4, 1);
+	bench(10000, 32, 2);
+	bench(20000, 8, 3);
+	bench(20000, 64, 4);
+	return 0;
+}
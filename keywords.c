@@ -0,0 +1,29 @@
+#include <string.h>
+#include "tokens.h"
+#include "keywords.gperf.h"
+static struct keyword_sym tab[]={
+{"and",T_AND},
+{"array",T_ARRAY},
+{"begin",T_BEGIN},
+{"char",T_CHAR},
+{"const",T_CONST},
+{"do",T_DO},
+{"downto",T_DOWNTO},
+{"else",T_ELSE},
+{"end",T_END},
+{"for",T_FOR},
+{"function",T_FUNCTION},
+{"if",T_IF},
+{"integer",T_INTEGER},
+{"not",T_NOT},
+{"of",T_OF},
+{"or",T_OR},
+{"procedure",T_PROCEDURE},
+{"read",T_READ},
+{"then",T_THEN},
+{"to",T_TO},
+{"var",T_VAR},
+{"while",T_WHILE},
+{"write",T_WRITE},
+};
+struct keyword_sym *gperf_keyword_sym(const char *s, unsigned len){for(unsigned i=0;i<sizeof tab/sizeof*tab;i++) if(strlen(tab[i].name)==len&&!memcmp(tab[i].name,s,len)) return &tab[i]; return 0;}
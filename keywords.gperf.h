@@ -0,0 +1,4 @@
+struct keyword_sym {
+	char *name;
+	int sym;
+};
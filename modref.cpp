@@ -0,0 +1,278 @@
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "semant.h"
+#include "translate.h"
+
+using namespace std;
+
+// Mod/ref analysis over the call graph of the whole program, before any
+// procedure is translated.  The sets of a procedure hold the scalars of
+// enclosing procedures (and globals) that its body reads or writes, and
+// those of every procedure it calls that are visible to it.  Its own
+// params and locals are left out, as every activation has fresh ones; a
+// nested procedure using them has them in its sets, so translate_call()
+// syncs them around a call to it.  The sets only grow, so iterating
+// until nothing changes handles recursion; visiting callees first (the
+// subs of a block come before it) makes one round enough otherwise.
+// A byref param may point to any scalar passed by reference anywhere in
+// the program, so a procedure that reads or writes through one, itself
+// or in a callee, refs or mods all of those it can see: those declared
+// by a procedure enclosing it, the main program included.
+
+namespace {
+
+struct Summary {
+	int level;
+	const ProcSymbol *up; // the enclosing procedure, nullptr for the main program
+	ModRef mr;
+	bool ref_aliased = false, mod_aliased = false; // through a byref param
+	vector<const ProcSymbol*> callees;
+};
+
+unordered_map<const ProcSymbol*, Summary> summaries;
+unordered_set<const VarSymbol*> aliased; // passed by reference somewhere
+unordered_map<const VarSymbol*, const ProcSymbol*> owner; // declaring procedure
+
+struct Scan {
+	Summary &s;
+	Scan(Summary &s): s(s) {}
+	void access(const Symbol *sym, bool ref, bool mod);
+	void lvalue(const Expr *e, bool ref, bool mod);
+	void call(const ProcSymbol *proc, const vector<unique_ptr<Expr>> &args);
+	void expr(const Expr *e);
+	void cond(const Cond *c);
+	void stmt(const Stmt *st);
+};
+
+void Scan::access(const Symbol *sym, bool ref, bool mod)
+{
+	if (sym->kind != Symbol::VAR)
+		return;
+	const VarSymbol *vs = static_cast<const VarSymbol*>(sym);
+	if (!vs->type->is_scalar())
+		return;
+	if (vs->isref) {
+		s.ref_aliased |= ref;
+		s.mod_aliased |= mod;
+	}
+	if (vs->level >= s.level)
+		return;
+	if (ref)
+		s.mr.ref.insert(vs);
+	if (mod)
+		s.mr.mod.insert(vs);
+}
+
+// array elements stay in memory, only the index is read
+void Scan::lvalue(const Expr *e, bool ref, bool mod)
+{
+	if (e->kind == Expr::INDEX)
+		expr(static_cast<const IndexExpr*>(e)->index.get());
+	else
+		access(static_cast<const SymExpr*>(e)->sym, ref, mod);
+}
+
+void Scan::call(const ProcSymbol *proc, const vector<unique_ptr<Expr>> &args)
+{
+	s.callees.push_back(proc);
+	for (size_t i=0; i<args.size(); i++) {
+		const Expr *e = args[i].get();
+		if (!proc->params[i].byref) {
+			expr(e);
+			continue;
+		}
+		if (e->kind == Expr::SYM) {
+			const Symbol *sym = static_cast<const SymExpr*>(e)->sym;
+			// a byref param passed on points where it did already
+			if (sym->kind == Symbol::VAR) {
+				const VarSymbol *vs = static_cast<const VarSymbol*>(sym);
+				if (!vs->isref && vs->type->is_scalar())
+					aliased.insert(vs);
+			}
+		}
+		lvalue(e, true, true);
+	}
+}
+
+void Scan::expr(const Expr *e)
+{
+	switch (e->kind) {
+	case Expr::SYM:
+		access(static_cast<const SymExpr*>(e)->sym, true, false);
+		break;
+	case Expr::LIT:
+		break;
+	case Expr::BINARY:
+		expr(static_cast<const BinaryExpr*>(e)->left.get());
+		expr(static_cast<const BinaryExpr*>(e)->right.get());
+		break;
+	case Expr::UNARY:
+		expr(static_cast<const UnaryExpr*>(e)->sub.get());
+		break;
+	case Expr::INDEX:
+		expr(static_cast<const IndexExpr*>(e)->index.get());
+		break;
+	case Expr::APPLY:
+		call(static_cast<const ApplyExpr*>(e)->func, static_cast<const ApplyExpr*>(e)->args);
+		break;
+	}
+}
+
+void Scan::cond(const Cond *c)
+{
+	switch (c->kind) {
+	case Cond::SIMPLE:
+		expr(static_cast<const SimpleCond*>(c)->left.get());
+		expr(static_cast<const SimpleCond*>(c)->right.get());
+		break;
+	case Cond::COMP:
+		cond(static_cast<const CompCond*>(c)->left.get());
+		cond(static_cast<const CompCond*>(c)->right.get());
+		break;
+	case Cond::NEG:
+		cond(static_cast<const NegCond*>(c)->sub.get());
+		break;
+	}
+}
+
+void Scan::stmt(const Stmt *st)
+{
+	switch (st->kind) {
+	case Stmt::EMPTY:
+		break;
+	case Stmt::COMP:
+		for (const unique_ptr<Stmt> &t: static_cast<const CompStmt*>(st)->body)
+			stmt(t.get());
+		break;
+	case Stmt::ASSIGN:
+		lvalue(static_cast<const AssignStmt*>(st)->var.get(), false, true);
+		expr(static_cast<const AssignStmt*>(st)->val.get());
+		break;
+	case Stmt::CALL:
+		call(static_cast<const CallStmt*>(st)->proc, static_cast<const CallStmt*>(st)->args);
+		break;
+	case Stmt::IF:
+		{
+			const IfStmt *t = static_cast<const IfStmt*>(st);
+			cond(t->cond.get());
+			stmt(t->st.get());
+			if (t->sf)
+				stmt(t->sf.get());
+		}
+		break;
+	case Stmt::WHILE:
+		cond(static_cast<const WhileStmt*>(st)->cond.get());
+		stmt(static_cast<const WhileStmt*>(st)->body.get());
+		break;
+	case Stmt::DO_WHILE:
+		cond(static_cast<const DoWhileStmt*>(st)->cond.get());
+		stmt(static_cast<const DoWhileStmt*>(st)->body.get());
+		break;
+	case Stmt::FOR:
+		{
+			const ForStmt *t = static_cast<const ForStmt*>(st);
+			lvalue(t->indvar.get(), true, true);
+			expr(t->from.get());
+			expr(t->to.get());
+			stmt(t->body.get());
+		}
+		break;
+	case Stmt::READ:
+		for (const unique_ptr<Expr> &v: static_cast<const ReadStmt*>(st)->vars)
+			lvalue(v.get(), false, true);
+		break;
+	case Stmt::WRITE:
+		if (static_cast<const WriteStmt*>(st)->val)
+			expr(static_cast<const WriteStmt*>(st)->val.get());
+		break;
+	}
+}
+
+void scan_block(const Block &blk, const ProcSymbol *up, vector<const ProcSymbol*> &order)
+{
+	for (const unique_ptr<Block> &sub: blk.subs)
+		scan_block(*sub, blk.proc, order);
+	for (const VarSymbol *vs: blk.params)
+		owner[vs] = blk.proc;
+	for (const VarSymbol *vs: blk.vars)
+		owner[vs] = blk.proc;
+	// the main program has a summary too, only for the byref args it
+	// passes, as nothing calls it
+	Summary &s = summaries[blk.proc];
+	s.level = blk.proc ? blk.proc->level : 0;
+	s.up = up;
+	Scan scan(s);
+	for (const unique_ptr<Stmt> &st: blk.stmts)
+		scan.stmt(st.get());
+	if (blk.proc)
+		order.push_back(blk.proc);
+}
+
+// whether vs is declared by a procedure enclosing p
+bool visible(const VarSymbol *vs, const ProcSymbol *p)
+{
+	const ProcSymbol *decl = owner.at(vs);
+	while (p) {
+		p = summaries.at(p).up;
+		if (p == decl)
+			return true;
+	}
+	return false;
+}
+
+}
+
+void compute_modref(const Block &prog)
+{
+	vector<const ProcSymbol*> order;
+	scan_block(prog, nullptr, order);
+	bool changed;
+	do {
+		changed = false;
+		for (const ProcSymbol *p: order) {
+			Summary &s = summaries.at(p);
+			for (const ProcSymbol *q: s.callees) {
+				if (q == p)
+					continue;
+				const Summary &t = summaries.at(q);
+				if ((t.ref_aliased && !s.ref_aliased) || (t.mod_aliased && !s.mod_aliased)) {
+					s.ref_aliased |= t.ref_aliased;
+					s.mod_aliased |= t.mod_aliased;
+					changed = true;
+				}
+				const ModRef &m = t.mr;
+				for (const VarSymbol *vs: m.ref)
+					if (vs->level < s.level && s.mr.ref.insert(vs).second)
+						changed = true;
+				for (const VarSymbol *vs: m.mod)
+					if (vs->level < s.level && s.mr.mod.insert(vs).second)
+						changed = true;
+			}
+		}
+	} while (changed);
+	for (const ProcSymbol *p: order) {
+		Summary &s = summaries.at(p);
+		for (const VarSymbol *vs: aliased) {
+			if (!visible(vs, p))
+				continue;
+			if (s.ref_aliased)
+				s.mr.ref.insert(vs);
+			if (s.mod_aliased)
+				s.mr.mod.insert(vs);
+		}
+	}
+}
+
+const ModRef &modref(const ProcSymbol *proc)
+{
+	return summaries.at(proc).mr;
+}
+
+bool is_aliased(const VarSymbol *vs)
+{
+	return aliased.count(vs);
+}
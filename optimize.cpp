@@ -1,12 +1,20 @@
 #include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
+#include "semant.h"
 #include "dynbitset.h"
+#include "arena.h"
 #include "translate.h"
 #include "dataflow.h"
 
@@ -29,8 +37,32 @@ string vector_int_tostr(const vector<int> &v)
 
 void TranslateEnv::insert_sync()
 {
+	// a byref param and a scalar passed by reference may be the same
+	// variable (see compute_modref()): each is written back as soon as it
+	// changes, and then the others are loaded again
+	dynbitset byref(scalar_id), aliased(scalar_id);
+	for (int a=0; a<scalar_id; a++) {
+		if (scalar_var[a]->isref)
+			byref.set(a);
+		else if (is_aliased(scalar_var[a]))
+			aliased.set(a);
+	}
+	if (!byref.empty() && !aliased.empty()) {
+		vector<Quad> oldquads(move(quads));
+		quads.clear();
+		for (const Quad &q: oldquads) {
+			quads.push_back(q);
+			int a = compute_def_temp(q);
+			if (a < 0 || a >= scalar_id || !(byref.get(a) || aliased.get(a)))
+				continue;
+			dynbitset self(scalar_id);
+			self.set(a);
+			quads.emplace_back(Quad::SYNCM, nullptr, synclist(self));
+			quads.emplace_back(Quad::SYNCR, nullptr, synclist(byref.get(a) ? aliased : byref));
+		}
+	}
 	int n = quads.size();
-	map<string, int> labelmap;
+	vector<int> labelmap(labelid);
 	vector<vector<int>> pred(n), succ(n);
 	vector<vector<int>> scalar_defsites(scalar_id);
 	vector<dynbitset> live_out(n, dynbitset(scalar_id));
@@ -43,7 +75,7 @@ void TranslateEnv::insert_sync()
 	for (int i=0; i<n; i++) {
 		const Quad &q(quads[i]);
 		if (q.op == Quad::LABEL) {
-			labelmap[static_cast<LabelOperand*>(q.c)->label] = i;
+			labelmap[static_cast<LabelOperand*>(q.c)->id] = i;
 		} else {
 			int a = compute_def_temp(q);
 			if (a >= 0 && a < scalar_id) {
@@ -64,7 +96,7 @@ void TranslateEnv::insert_sync()
 	for (int i=0; i<n; i++) {
 		const Quad &q = quads[i];
 		if (q.is_jump_or_branch()) {
-			int dst = labelmap[static_cast<LabelOperand*>(q.c)->label];
+			int dst = labelmap[static_cast<LabelOperand*>(q.c)->id];
 			pred[dst].push_back(i);
 			succ[i].push_back(dst);
 		}
@@ -175,157 +207,116 @@ void TranslateEnv::insert_sync()
 	}
 }
 
-void TranslateEnv::optimize()
+// the ssa pass; build_cfg() has split the critical edges, so from_ssa()
+// can put the copies for a phi at the end of its predecessors
+void TranslateEnv::to_ssa()
 {
 #if 0
-	fprintf(stderr, "optimize: %s\n", procname.c_str());
+	fprintf(stderr, "to_ssa: %s\n", procname.c_str());
 #endif
-	insert_sync();
-	vector<unique_ptr<BB>> blocks = partition(quads);
-	dump_cfg(procname, blocks);
-	split_edges(blocks);
-	dump_cfg(procname+"-split", blocks);
-#if 1
 	// compute dominator tree and dominance frontier
 	int n = blocks.size();
-	vector<dynbitset> dom(n, dynbitset(n));
-	vector<int> idom(n, -1);
-	// dominator of the start node is itself
-	dom[0].set(0);
-	// for all other nodes, set all nodes as the dominators
-	for (int i=1; i<n; i++)
-		dom[i].set_all();
-	// iteratively eliminate nodes that are not dominators
-	bool changed;
-	do {
-		changed = false;
-		for (int i=1; i<n; i++) {
-			dynbitset s(n);
-			s.set_all();
-			for (const BB *p: blocks[i]->pred)
-				s &= dom[p->id];
-			s.set(i);
-			if (dom[i].update(s))
-				changed = true;
-		}
-	} while (changed);
+	DomTree dt;
+	dt.build(blocks);
 #if 0
 	for (int i=0; i<n; i++) {
-		fprintf(stderr, "dom[%d]=%s\n", i, dom[i].tostr().c_str());
+		fprintf(stderr, "idom[%d]=%d DF[%d]=%s\n", i, dt.idom[i], i,
+			vector_int_tostr(dt.df[i]).c_str());
 	}
 #endif
-	vector<dynbitset> sdom(dom);
-	for (int i=0; i<n; i++)
-		sdom[i].clear(i);
-	vector<dynbitset> children(n, dynbitset(n));
-	for (int i=1; i<n; i++) {
-		dynbitset s(n);
-		// union sdom[j] for j in sdom[i]
-		sdom[i].foreach([&](int j){ s |= sdom[j]; });
-		// should contain exactly 1 element, that is the idom
-		s = sdom[i]-s;
-		s.foreach([&](int j) {
-			assert(idom[i] < 0);
-			idom[i] = j;
-		});
-#if 0
-		fprintf(stderr, "idom[%d]=%d\n", i, idom[i]);
-#endif
-		children[idom[i]].set(i);
-	}
-	vector<dynbitset> domfront(n, dynbitset(n));
-	// DF[i] = DF_local[i] | |DF_up[c] for c in children[i]
-	function<void(int)> compute_df = [&](int i) {
-		dynbitset s(n);
-		// this loop computes DF_local[n]
-		for (const BB *succ: blocks[i]->succ) {
-			int y = succ->id;
-			if (idom[y] != i)
-				s.set(y);
-		}
-		children[i].foreach([&](int c) {
-			compute_df(c);
-			// this loop computes DF_up[c]
-			domfront[c].foreach([&](int w) {
-				if (!dom[w].get(i)) // i not in dom[w]; that is i does not dominate w
-					s.set(w);
-			});
-		});
-		domfront[i] = s;
-	};
-	for (int i=0; i<n; i++) {
-		compute_df(i);
-#if 0
-		fprintf(stderr, "DF[%d]=%s\n", i, domfront[i].tostr().c_str());
-#endif
-	}
-	//
-	vector<dynbitset> defsites(tempid, dynbitset(n));
+	// semi-pruned SSA: only temporaries used in some block before being
+	// defined there can need a phi function
+	vector<vector<int>> defsites(tempid);
+	vector<char> global(tempid);
+	vector<int> defined_in(tempid, -1);
 	for (const unique_ptr<BB> &p: blocks) {
 		const BB *bb = p.get();
-		dynbitset bdefs(tempid);
 		for (const Quad &q: bb->quads) {
+			for_each_use(q, [&](int a){
+				if (a >= 0 && defined_in[a] != bb->id)
+					global[a] = true;
+			});
 			int def = compute_def_temp(q);
-			if (def >= 0)
-				bdefs.set(def);
+			if (def >= 0) {
+				defined_in[def] = bb->id;
+				if (defsites[def].empty() || defsites[def].back() != bb->id)
+					defsites[def].push_back(bb->id);
+			}
 		}
-		bdefs.foreach([&](int a) {
-			defsites[a].set(bb->id);
-		});
 	}
-#if 0
-	for (int a=0; a<tempid; a++) {
-		fprintf(stderr, "defsites[%d]=%s\n", a, defsites[a].tostr().c_str());
-	}
-#endif
 	// place phi functions
-	// for each scalar a
+	vector<int> has_phi(n, -1), work_for(n, -1); // last a for which the block was handled
+	vector<int> w;
 	for (int a=0; a<tempid; a++) {
-		dynbitset f(n); // set of blocks where phi is added
-		dynbitset w(defsites[a]);
+		if (!global[a])
+			continue;
+		w = defsites[a];
+		for (int x: w)
+			work_for[x] = a;
 		while (!w.empty()) {
-			int x = w.first();
-			w.clear(x);
-			domfront[x].foreach([&](int y) {
-				if (!f.get(y)) {
+			int x = w.back();
+			w.pop_back();
+			for (int y: dt.df[x]) {
+				if (has_phi[y] != a) {
 					BB &block_y(*blocks[y]);
 					// insert phi at block y
 					int npred = block_y.pred.size();
-					Operand **args = (Operand **) calloc(npred+1, sizeof *args);
+					Operand **args = arena.make_array<Operand*>(npred+1);
 #if 1
 					for (int i=0; i<npred; i++)
 						args[i] = temps[a];
 #endif
 					block_y.quads.emplace(block_y.quads.begin(), Quad::PHI, temps[a], args);
-					f.set(y);
-					if (!defsites[a].get(y))
-						w.set(y);
+					has_phi[y] = a;
+					if (work_for[y] != a) {
+						work_for[y] = a;
+						w.push_back(y);
+					}
 				}
-			});
+			}
 		}
 	}
-	// rename variables
-	function<void(int, vector<vector<int>>)> rename = [&](int b, vector<vector<int>> stack) {
+	// rename variables, walking the dominator tree; ~b marks the point
+	// where the definitions made in block b go out of scope
+	vector<vector<int>> stack(tempid);
+	vector<char> part(tempid); // also used as a byte, see resize()
+	for (int a: part_temps)
+		if (a >= 0)
+			part[a] = true;
+	for (int a=0; a<tempid; a++)
+		stack[a].push_back(a);
+	vector<vector<int>> pushed(n);
+	vector<int> walk{0};
+	vector<int> uses;
+	while (!walk.empty()) {
+		int b = walk.back();
+		walk.pop_back();
+		if (b < 0) {
+			for (int a: pushed[~b])
+				stack[a].pop_back();
+			continue;
+		}
 		for (Quad &q: blocks[b]->quads) {
 			// rename variables used in each non-phi quad
 			if (q.op != Quad::PHI) {
-				dynbitset use(tempid);
+				uses.clear();
 				for_each_use(q, [&](int a){
 					if (a >= 0)
-						use.set(a);
-				});
-				use.foreach([&](int a){
-					int newa = stack[a].back();
-					replace_use(q, a, newa);
+						uses.push_back(a);
 				});
+				for (int a: uses)
+					replace_use(q, a, stack[a].back(), *this);
 			}
 			// rename variables defined in each quad
 			int a = compute_def_temp(q);
 			if (a >= 0) {
 				int size = temps[a]->size;
 				int newa = newtemp(size)->id;
+				if (part[a] && size == 4)
+					part_temps.push_back(newa);
 				stack[a].push_back(newa);
-				replace_def(q, a, newa);
+				pushed[b].push_back(a);
+				replace_def(q, a, newa, *this);
 			}
 		}
 		for (BB *succ: blocks[b]->succ) {
@@ -342,30 +333,1240 @@ void TranslateEnv::optimize()
 				Operand *arg = q.args[j];
 				assert(arg->istemp());
 				TempOperand *t = astemp(arg);
-				q.args[j] = new TempOperand(t->size, stack[t->id].back());
+				q.args[j] = temp(t->size, stack[t->id].back());
+			}
+		}
+		walk.push_back(~b);
+		for (auto it = dt.children[b].rbegin(); it != dt.children[b].rend(); it++)
+			walk.push_back(*it);
+	}
+}
+
+static int truncate(int v, int size)
+{
+	return size == 1 ? int8_t(v) : v;
+}
+
+// value of c in c = a op b, for the quads that sccp() folds
+static bool fold(Quad::Op op, int size, int a, int b, int &r)
+{
+	switch (op) {
+	case Quad::MOV:
+	case Quad::SEX:
+		r = a;
+		break;
+	case Quad::ADD3:
+		r = int(unsigned(a)+unsigned(b));
+		break;
+	case Quad::SUB3:
+		r = int(unsigned(a)-unsigned(b));
+		break;
+	case Quad::MUL3:
+		r = int(unsigned(a)*unsigned(b));
+		break;
+	case Quad::DIV3:
+		// leave the division that traps at run time
+		if (b == 0 || (b == -1 && a == (size == 1 ? INT8_MIN : INT_MIN)))
+			return false;
+		r = a/b;
+		break;
+	case Quad::NEG2:
+		r = int(-unsigned(a));
+		break;
+	default:
+		return false;
+	}
+	r = truncate(r, size);
+	return true;
+}
+
+static bool branch_taken(Quad::Op op, int a, int b)
+{
+	switch (op) {
+	case Quad::BEQ: return a == b;
+	case Quad::BNE: return a != b;
+	case Quad::BLT: return a <  b;
+	case Quad::BGE: return a >= b;
+	case Quad::BGT: return a >  b;
+	case Quad::BLE: return a <= b;
+	default: assert(0);
+	}
+	return false;
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck).  Temporaries
+// found to be constant are replaced by immediates and their definitions
+// deleted, branches with a known outcome become fallthroughs, and blocks
+// never reached are removed.
+void TranslateEnv::sccp()
+{
+	enum { TOP, CONST, BOTTOM };
+	int n = blocks.size();
+	vector<char> state(tempid, BOTTOM);
+	vector<int> val(tempid);
+	vector<vector<pair<int,int>>> uses(tempid); // (block, quad) pairs
+	for (int b=0; b<n; b++) {
+		const vector<Quad> &qs = blocks[b]->quads;
+		for (int i=0; i<int(qs.size()); i++) {
+			const Quad &q = qs[i];
+			if (q.op == Quad::PHI) {
+				for (Operand **p = q.args; *p; p++)
+					if ((*p)->istemp() && astemp(*p)->id >= 0)
+						uses[astemp(*p)->id].emplace_back(b, i);
+			} else {
+				for_each_use(q, [&](int a){
+					if (a >= 0)
+						uses[a].emplace_back(b, i);
+				});
+			}
+			// temporaries without a definition keep BOTTOM
+			int def = compute_def_temp(q);
+			if (def >= 0)
+				state[def] = TOP;
+		}
+	}
+	auto value = [&](Operand *o, int &v) -> int {
+		if (o->isimm()) {
+			v = truncate(static_cast<ImmOperand*>(o)->val, o->size);
+			return CONST;
+		}
+		if (o->istemp() && astemp(o)->id >= 0) {
+			v = val[astemp(o)->id];
+			return state[astemp(o)->id];
+		}
+		return BOTTOM;
+	};
+	vector<char> visited(n);
+	vector<vector<char>> exec_in(n); // per predecessor
+	for (int b=0; b<n; b++)
+		exec_in[b].assign(blocks[b]->pred.size(), false);
+	vector<int> flow{0};
+	vector<pair<int,int>> work;
+	auto lower_to = [&](int t, int s, int v) {
+		if (state[t] == BOTTOM || (state[t] == s && val[t] == v))
+			return;
+		state[t] = s == CONST && state[t] == CONST ? BOTTOM : s;
+		val[t] = v;
+		for (const pair<int,int> &u: uses[t])
+			work.push_back(u);
+	};
+	auto mark_edge = [&](BB *p, BB *s) {
+		vector<BB*> &pred = s->pred;
+		int j = find(pred.begin(), pred.end(), p)-pred.begin();
+		if (exec_in[s->id][j])
+			return;
+		exec_in[s->id][j] = true;
+		if (!visited[s->id]) {
+			flow.push_back(s->id);
+		} else {
+			const vector<Quad> &qs = s->quads;
+			for (int i=0; i<int(qs.size()) && qs[i].op == Quad::PHI; i++)
+				work.emplace_back(s->id, i);
+		}
+	};
+	auto visit = [&](int b, int i) {
+		BB *bb = blocks[b].get();
+		const Quad &q = bb->quads[i];
+		if (q.op == Quad::PHI) {
+			int t = astemp(q.c)->id;
+			int s = TOP, v = 0;
+			for (int j=0; q.args[j]; j++) {
+				int w;
+				if (!exec_in[b][j])
+					continue;
+				int sj = value(q.args[j], w);
+				if (sj == TOP)
+					continue;
+				if (sj == BOTTOM || (s == CONST && v != w)) {
+					s = BOTTOM;
+					break;
+				}
+				s = CONST;
+				v = w;
+			}
+			if (s != TOP)
+				lower_to(t, s, v);
+			return;
+		}
+		if (q.isbranch()) {
+			int a, c;
+			int sa = value(q.a, a), sc = value(q.b, c);
+			if (sa == BOTTOM || sc == BOTTOM) {
+				mark_edge(bb, bb->succ[0]);
+				mark_edge(bb, bb->succ[1]);
+			} else if (sa == CONST && sc == CONST) {
+				mark_edge(bb, bb->succ[branch_taken(q.op, a, c)]);
+			}
+			return;
+		}
+		int t = compute_def_temp(q);
+		if (t < 0)
+			return;
+		int a = 0, c = 0;
+		int s = BOTTOM;
+		switch (q.op) {
+		case Quad::ADD3:
+		case Quad::SUB3:
+		case Quad::MUL3:
+		case Quad::DIV3:
+			s = max(value(q.a, a), value(q.b, c));
+			break;
+		case Quad::MOV:
+		case Quad::SEX:
+		case Quad::NEG2:
+			s = value(q.a, a);
+			break;
+		default:
+			break;
+		}
+		if (s == CONST) {
+			int r;
+			if (fold(q.op, q.c->size, a, c, r))
+				lower_to(t, CONST, r);
+			else
+				lower_to(t, BOTTOM, 0);
+		} else if (s == BOTTOM) {
+			lower_to(t, BOTTOM, 0);
+		}
+	};
+	while (!flow.empty() || !work.empty()) {
+		if (!flow.empty()) {
+			int b = flow.back();
+			flow.pop_back();
+			if (visited[b])
+				continue;
+			visited[b] = true;
+			BB *bb = blocks[b].get();
+			for (int i=0; i<int(bb->quads.size()); i++)
+				visit(b, i);
+			if (bb->quads.empty() || !bb->quads.back().isbranch())
+				for (BB *s: bb->succ)
+					mark_edge(bb, s);
+		} else {
+			pair<int,int> u = work.back();
+			work.pop_back();
+			if (visited[u.first])
+				visit(u.first, u.second);
+		}
+	}
+
+	// rewrite the code
+	auto subst = [&](Operand *&o) {
+		if (o->istemp()) {
+			int id = astemp(o)->id;
+			if (id >= 0 && state[id] == CONST)
+				o = imm(o->size == 1 ? val[id] & 0xff : val[id], o->size);
+		} else if (o->ismem()) {
+			MemOperand *m = asmem(o);
+			Operand *base = m->base;
+			int offset = m->offset;
+			Operand *index = m->index;
+			int scale = m->scale;
+			if (base && base->istemp() && astemp(base)->id >= 0 &&
+			    state[astemp(base)->id] == CONST) {
+				offset += val[astemp(base)->id];
+				base = nullptr;
+			}
+			if (index && index->istemp() && astemp(index)->id >= 0 &&
+			    state[astemp(index)->id] == CONST) {
+				offset += val[astemp(index)->id]*scale;
+				index = nullptr;
+				scale = 0;
+			}
+			if (base != m->base || index != m->index)
+				o = mem(m->size, base, offset, index, scale);
+		}
+	};
+	// drop the edges never taken, and branches left with one of them
+	for (int b=0; b<n; b++) {
+		if (!visited[b])
+			continue;
+		BB *bb = blocks[b].get();
+		vector<BB*> succ;
+		for (BB *s: bb->succ) {
+			const vector<BB*> &pred = s->pred;
+			if (exec_in[s->id][find(pred.begin(), pred.end(), bb)-pred.begin()])
+				succ.push_back(s);
+		}
+		assert(!succ.empty() || bb->succ.empty());
+		if (succ.size() < bb->succ.size() && bb->quads.back().isbranch())
+			bb->quads.pop_back();
+		bb->succ = move(succ);
+	}
+	for (int b=0; b<n; b++) {
+		if (!visited[b])
+			continue;
+		BB *bb = blocks[b].get();
+		vector<BB*> pred;
+		vector<int> keep;
+		for (int j=0; j<int(bb->pred.size()); j++) {
+			if (exec_in[b][j]) {
+				pred.push_back(bb->pred[j]);
+				keep.push_back(j);
+			}
+		}
+		if (pred.size() == bb->pred.size())
+			continue;
+		for (auto it = bb->quads.begin(); it != bb->quads.end() && it->op == Quad::PHI; it++) {
+			int k;
+			for (k=0; k<int(keep.size()); k++)
+				it->args[k] = it->args[keep[k]];
+			it->args[k] = nullptr;
+		}
+		bb->pred = move(pred);
+	}
+	// replace the constants
+	for (int b=0; b<n; b++) {
+		if (!visited[b])
+			continue;
+		vector<Quad> &qs = blocks[b]->quads;
+		auto out = qs.begin();
+		for (Quad &q: qs) {
+			int t = compute_def_temp(q);
+			if (t >= 0 && state[t] == CONST)
+				continue;
+			if (q.op == Quad::PHI) {
+				for (Operand **p = q.args; *p; p++)
+					subst(*p);
+			} else if (q.c && q.c->ismem() &&
+				   ((q.op >= Quad::ADD3 && q.op <= Quad::NEG2) || q.op == Quad::SEX)) {
+				// a store of a value that turned out constant
+				int a = 0, c = 0, r;
+				int s = value(q.a, a);
+				if (q.op >= Quad::ADD3 && q.op <= Quad::DIV3)
+					s = max(s, value(q.b, c));
+				if (s == CONST && fold(q.op, q.c->size, a, c, r))
+					q = Quad(Quad::MOV, q.c, imm(q.c->size == 1 ? r & 0xff : r, q.c->size));
+				subst(q.c);
+				subst(q.a);
+				if (q.b)
+					subst(q.b);
+			} else {
+				if (q.c && (q.c->ismem() || q.op == Quad::PUSH))
+					subst(q.c);
+				// sign extension takes a register or memory, but
+				// the index in memory may still fold
+				if (q.a && (q.op != Quad::SEX || q.a->ismem()))
+					subst(q.a);
+				if (q.b)
+					subst(q.b);
+			}
+			*out++ = q;
+		}
+		qs.erase(out, qs.end());
+	}
+	// remove the blocks never reached
+	auto out = blocks.begin();
+	for (unique_ptr<BB> &p: blocks) {
+		if (visited[p->id]) {
+			p->id = out-blocks.begin();
+			*out++ = move(p);
+		}
+	}
+	blocks.erase(out, blocks.end());
+}
+
+// key of an expression for gvn(); operands are interned, so they compare
+// by address
+struct ExprKey {
+	Quad::Op op;
+	int size;
+	Operand *a, *b;
+	bool operator==(const ExprKey &that) const
+	{
+		return op == that.op && size == that.size &&
+			a == that.a && b == that.b;
+	}
+};
+
+struct ExprKeyHash {
+	size_t operator()(const ExprKey &k) const
+	{
+		size_t h = std::hash<Operand*>()(k.a);
+		h = h*31 + std::hash<Operand*>()(k.b);
+		h = h*31 + k.size;
+		return h*31 + k.op;
+	}
+};
+
+// Global value numbering in the style of Briggs, Cooper and Simpson: walk
+// the dominator tree with a scoped table of the expressions computed so
+// far, and delete every ADD3/SUB3/MUL3/DIV3/LEA/SEX whose value a
+// dominating quad already holds, renaming its uses.  Those reading memory
+// are left alone.
+// Copies between temporaries of one size are propagated the same way: the
+// source dominates every use of the destination, which it replaces.
+void TranslateEnv::gvn()
+{
+	int n = blocks.size();
+	DomTree dt;
+	dt.build(blocks);
+	vector<int> rep(tempid), vn(tempid);
+	for (int t=0; t<tempid; t++)
+		rep[t] = vn[t] = t;
+	vector<char> part(tempid); // see to_ssa()
+	for (int a: part_temps)
+		if (a >= 0)
+			part[a] = true;
+	auto number_temp = [&](Operand *o) -> Operand * {
+		if (o && o->istemp() && astemp(o)->id >= 0)
+			return temp(o->size, vn[astemp(o)->id]);
+		return o;
+	};
+	auto number = [&](Operand *o) -> Operand * {
+		if (o && o->ismem()) {
+			MemOperand *m = asmem(o);
+			return mem(m->size, number_temp(m->base), m->offset,
+				   number_temp(m->index), m->scale);
+		}
+		return number_temp(o);
+	};
+	unordered_map<ExprKey, int, ExprKeyHash> avail;
+	vector<vector<ExprKey>> added(n);
+	vector<int> walk{0};
+	vector<int> uses;
+	while (!walk.empty()) {
+		int b = walk.back();
+		walk.pop_back();
+		if (b < 0) {
+			for (const ExprKey &k: added[~b])
+				avail.erase(k);
+			continue;
+		}
+		vector<Quad> &qs = blocks[b]->quads;
+		auto out = qs.begin();
+		for (Quad &q: qs) {
+			if (q.op != Quad::PHI) {
+				uses.clear();
+				for_each_use(q, [&](int a){
+					if (a >= 0 && rep[a] != a)
+						uses.push_back(a);
+				});
+				for (int a: uses)
+					replace_use(q, a, rep[a], *this);
+			}
+			int t = compute_def_temp(q);
+			switch (t < 0 ? Quad::PHI : q.op) {
+			case Quad::MOV:
+				if (q.a->istemp() && astemp(q.a)->id >= 0 && q.a->size == q.c->size) {
+					int a = astemp(q.a)->id;
+					if (temps[t]->size == q.c->size && temps[a]->size == q.a->size) {
+						rep[t] = a;
+						vn[t] = vn[a];
+						// a takes over the byte uses of t
+						if (part[t] && !part[a]) {
+							part[a] = true;
+							part_temps.push_back(a);
+						}
+						npropagated++;
+						continue;
+					}
+					vn[t] = vn[a];
+				}
+				break;
+			case Quad::ADD3:
+			case Quad::MUL3:
+			case Quad::SUB3:
+			case Quad::DIV3:
+			case Quad::LEA:
+			case Quad::SEX:
+				// a load may see a different value each time, as
+				// there are stores and calls in between
+				if (q.op != Quad::LEA && (q.a->ismem() || (q.b && q.b->ismem())))
+					break;
+				{
+					ExprKey k{q.op, q.c->size, number(q.a), number(q.b)};
+					if ((q.op == Quad::ADD3 || q.op == Quad::MUL3) && k.a > k.b)
+						swap(k.a, k.b);
+					auto it = avail.find(k);
+					if (it != avail.end()) {
+						rep[t] = it->second;
+						vn[t] = vn[it->second];
+						// it->second takes over the byte uses of t
+						if (part[t] && !part[it->second]) {
+							part[it->second] = true;
+							part_temps.push_back(it->second);
+						}
+						neliminated++;
+						continue;
+					}
+					avail.emplace(k, t);
+					added[b].push_back(k);
+				}
+				break;
+			default:
+				break;
+			}
+			*out++ = q;
+		}
+		qs.erase(out, qs.end());
+		walk.push_back(~b);
+		for (auto it = dt.children[b].rbegin(); it != dt.children[b].rend(); it++)
+			walk.push_back(*it);
+	}
+	for (const unique_ptr<BB> &p: blocks) {
+		for (auto it = p->quads.begin(); it != p->quads.end() && it->op == Quad::PHI; it++) {
+			for (Operand **a = it->args; *a; a++) {
+				if ((*a)->istemp() && astemp(*a)->id >= 0)
+					*a = temp((*a)->size, rep[astemp(*a)->id]);
+			}
+		}
+	}
+}
+
+// Give every loop a preheader, a block whose only successor is the header
+// and through which all the edges entering the loop pass.  After
+// split_edges() a single edge from outside already comes from such a
+// block; several are redirected to a new block, where a phi merges the
+// values they bring to each phi of the header.
+void TranslateEnv::insert_preheaders()
+{
+	DomTree dt;
+	dt.build(blocks);
+	LoopNest ln;
+	ln.build(blocks, dt);
+	vector<char> part(tempid); // see to_ssa()
+	for (int a: part_temps)
+		if (a >= 0)
+			part[a] = true;
+	for (const Loop &l: ln.loops) {
+		BB *h = blocks[l.header].get();
+		vector<int> in, out; // positions in h->pred
+		for (int j=0; j<int(h->pred.size()); j++)
+			(l.contains(h->pred[j]->id) ? in : out).push_back(j);
+		assert(!out.empty());
+		if (out.size() == 1 && h->pred[out[0]]->succ.size() == 1)
+			continue;
+		BB *ph = new BB(blocks.size());
+		blocks.emplace_back(ph);
+		ph->succ.push_back(h);
+		for (int j: out) {
+			BB *p = h->pred[j];
+			*find(p->succ.begin(), p->succ.end(), h) = ph;
+			ph->pred.push_back(p);
+		}
+		int nout = out.size(), nin = in.size();
+		for (auto it = h->quads.begin(); it != h->quads.end() && it->op == Quad::PHI; it++) {
+			Operand *v;
+			if (nout == 1) {
+				v = it->args[out[0]];
+			} else {
+				Operand **args = arena.make_array<Operand*>(nout+1);
+				for (int k=0; k<nout; k++)
+					args[k] = it->args[out[k]];
+				int size = it->c->size;
+				TempOperand *t = newtemp(size);
+				if (part[astemp(it->c)->id] && size == 4)
+					part_temps.push_back(t->id);
+				ph->quads.emplace_back(Quad::PHI, t, args);
+				v = t;
 			}
+			Operand **args = arena.make_array<Operand*>(nin+2);
+			for (int k=0; k<nin; k++)
+				args[k] = it->args[in[k]];
+			args[nin] = v;
+			it->args = args;
 		}
-		children[b].foreach([&](int child){
-			rename(child, stack);
+		vector<BB*> pred;
+		for (int j: in)
+			pred.push_back(h->pred[j]);
+		pred.push_back(ph);
+		h->pred = move(pred);
+	}
+}
+
+// Whether the value of o is the same in every iteration of loop l, going by
+// the blocks defining the temporaries; memory operands are not.
+static bool is_invariant(Operand *o, const Loop &l, const vector<int> &defblock)
+{
+	if (!o || o->isimm() || o->islabel())
+		return true;
+	if (!o->istemp())
+		return false;
+	int a = astemp(o)->id;
+	if (a < 0)
+		return o == ebp;
+	return defblock[a] < 0 || !l.contains(defblock[a]);
+}
+
+// Loop-invariant code motion.  Loops are visited from the innermost out,
+// and a quad that cannot fault and whose operands are all defined outside
+// the loop moves to the preheader; in SSA form nothing else writes its
+// temporary, so this is safe even from a conditional part of the loop.
+// The pointers loaded by the memory operands of outer variables and
+// reference parameters (see translate_varsym()) are invariant as well
+// unless the loop stores to them, and each is then loaded once into a
+// temporary in the preheader.  Static links are never assigned, but a
+// tail call to the procedure itself rebinds its reference parameters
+// before jumping back to the entry (see translate_tail_call()).
+void TranslateEnv::licm()
+{
+	insert_preheaders();
+	int n = blocks.size();
+	DomTree dt;
+	dt.build(blocks);
+	LoopNest ln;
+	ln.build(blocks, dt);
+	vector<int> defblock(tempid, -1);
+	for (const unique_ptr<BB> &p: blocks) {
+		for (const Quad &q: p->quads) {
+			int t = compute_def_temp(q);
+			if (t >= 0)
+				defblock[t] = p->id;
+		}
+	}
+	vector<int> rpo_pos(n, -1);
+	for (int i=0; i<int(dt.rpo.size()); i++)
+		rpo_pos[dt.rpo[i]] = i;
+	unordered_set<int> ptrload; // temporaries loaded by unnest
+	for (const Loop &l: ln.loops) {
+		BB *ph = nullptr;
+		for (BB *p: blocks[l.header]->pred) {
+			if (!l.contains(p->id)) {
+				assert(!ph);
+				ph = p;
+			}
+		}
+		assert(ph && ph->succ.size() == 1);
+		auto invariant = [&](Operand *o) {
+			return is_invariant(o, l, defblock);
+		};
+		unordered_set<Operand*> stored;
+		for (int b: l.blocks) {
+			for (const Quad &q: blocks[b]->quads) {
+				if (q.op != Quad::PHI && q.c && q.c->ismem())
+					stored.insert(q.c);
+			}
+		}
+		unordered_map<MemOperand*, TempOperand*> ptr;
+		function<Operand *(Operand *)> unnest = [&](Operand *o) -> Operand * {
+			if (!o || !o->ismem() || !asmem(o)->base->ismem() ||
+			    stored.count(asmem(o)->base))
+				return o;
+			MemOperand *m = asmem(o);
+			TempOperand *&t = ptr[asmem(m->base)];
+			if (!t) {
+				Operand *src = unnest(m->base);
+				t = newtemp(4);
+				ph->quads.emplace_back(Quad::MOV, t, src);
+				defblock.push_back(ph->id);
+				ptrload.insert(t->id);
+				nhoisted++;
+			}
+			return mem(m->size, t, m->offset, m->index, m->scale);
+		};
+		vector<int> body = l.blocks;
+		sort(body.begin(), body.end(), [&](int a, int b) {
+			return rpo_pos[a] < rpo_pos[b];
 		});
+		for (int b: body) {
+			vector<Quad> &qs = blocks[b]->quads;
+			auto out = qs.begin();
+			for (Quad &q: qs) {
+				if (q.op != Quad::PHI) {
+					q.c = unnest(q.c);
+					q.a = unnest(q.a);
+					q.b = unnest(q.b);
+				}
+				int t = compute_def_temp(q);
+				bool hoist = false;
+				switch (t < 0 ? Quad::PHI : q.op) {
+				case Quad::DIV3:
+					// may trap otherwise
+					if (!q.b->isimm() || static_cast<ImmOperand*>(q.b)->val == 0 ||
+					    static_cast<ImmOperand*>(q.b)->val == -1)
+						break;
+					/* fallthrough */
+				case Quad::ADD3:
+				case Quad::SUB3:
+				case Quad::MUL3:
+				case Quad::NEG2:
+				case Quad::SEX:
+					hoist = invariant(q.a) && invariant(q.b);
+					break;
+				case Quad::MOV:
+					// constants are better left where they are used
+					if (q.a->istemp())
+						hoist = invariant(q.a);
+					else if (ptrload.count(t))
+						hoist = invariant(asmem(q.a)->base);
+					break;
+				case Quad::LEA:
+					hoist = invariant(asmem(q.a)->base) && invariant(asmem(q.a)->index);
+					break;
+				default:
+					break;
+				}
+				if (hoist) {
+					ph->quads.push_back(q);
+					defblock[t] = ph->id;
+					nhoisted++;
+				} else {
+					*out++ = q;
+				}
+			}
+			qs.erase(out, qs.end());
+		}
+	}
+}
+
+// Value iv*mul+add of a temporary in a loop, iv being a basic induction
+// variable; the arithmetic wraps around like the code computing it.
+struct Affine {
+	int iv;
+	unsigned mul, add;
+};
+
+// Strength reduction of induction variables.  In a loop whose header has
+// an edge from the preheader and a single back edge, a basic induction
+// variable i is a phi of the header that every iteration advances by a
+// constant step, and the temporaries computed from it by adding,
+// subtracting or multiplying constants are derived ones, i*mul+add.  Each
+// address [base+j*scale] with an invariant base and a derived j, and each
+// multiplication yielding a derived value, is rewritten in terms of a new
+// variable base+i*mul*scale, which is bumped next to i.
+// Linear-function test replacement then makes an exit test of i compare
+// the new variable instead, leaving i to dce().  Nothing is done unless i
+// does die, and its new variables are no more than the quads saved,
+// not counting the step of i.
+// So that no comparison can overflow, this is only done when the new
+// variable addresses memory on every iteration and the loop is entered
+// only if the test holds for the initial value of i, as in the inverted
+// for loops of -O2 (see ForStmt::translate()).
+void TranslateEnv::reduce_iv()
+{
+	insert_preheaders();
+	int n = blocks.size();
+	DomTree dt;
+	dt.build(blocks);
+	LoopNest ln;
+	ln.build(blocks, dt);
+	vector<int> defblock(tempid, -1);
+	for (const unique_ptr<BB> &p: blocks) {
+		for (const Quad &q: p->quads) {
+			int t = compute_def_temp(q);
+			if (t >= 0)
+				defblock[t] = p->id;
+		}
+	}
+	auto newtemp_in = [&](const BB *b) {
+		TempOperand *t = newtemp(4);
+		defblock.push_back(b->id);
+		return t;
 	};
-	vector<vector<int>> stack(tempid);
-	for (int a=0; a<tempid; a++)
-		stack[a].push_back(a);
-	rename(0, stack);
-	dump_cfg(procname+"-ssa", blocks);
-#endif
-	// convert back from SSA
+	vector<int> rpo_pos(n, -1);
+	for (int i=0; i<int(dt.rpo.size()); i++)
+		rpo_pos[dt.rpo[i]] = i;
+	auto immval = [](Operand *o) -> unsigned {
+		return static_cast<ImmOperand*>(o)->val;
+	};
+	for (const Loop &l: ln.loops) {
+		BB *h = blocks[l.header].get();
+		if (h->pred.size() != 2 || l.contains(h->pred[0]->id) == l.contains(h->pred[1]->id))
+			continue;
+		int jp = l.contains(h->pred[0]->id), jl = !jp;
+		BB *ph = h->pred[jp];
+		vector<int> body = l.blocks;
+		sort(body.begin(), body.end(), [&](int a, int b) {
+			return rpo_pos[a] < rpo_pos[b];
+		});
+		unordered_map<int, Affine> aff;
+		auto lookup = [&](Operand *o, Affine &a) {
+			if (!o || !o->istemp())
+				return false;
+			auto it = aff.find(astemp(o)->id);
+			if (it == aff.end())
+				return false;
+			a = it->second;
+			return true;
+		};
+		auto analyze = [&](const vector<int> &ivs) {
+			aff.clear();
+			for (int x: ivs)
+				aff[x] = Affine{x, 1, 0};
+			for (int b: body) {
+				for (const Quad &q: blocks[b]->quads) {
+					int t = compute_def_temp(q);
+					Affine x;
+					if (t < 0 || q.c->size != 4)
+						continue;
+					switch (q.op) {
+					case Quad::MOV:
+						if (q.a->size == 4 && lookup(q.a, x))
+							aff[t] = x;
+						break;
+					case Quad::ADD3:
+						if (lookup(q.a, x) && q.b->isimm())
+							aff[t] = Affine{x.iv, x.mul, x.add+immval(q.b)};
+						else if (q.a->isimm() && lookup(q.b, x))
+							aff[t] = Affine{x.iv, x.mul, x.add+immval(q.a)};
+						break;
+					case Quad::SUB3:
+						if (lookup(q.a, x) && q.b->isimm())
+							aff[t] = Affine{x.iv, x.mul, x.add-immval(q.b)};
+						break;
+					case Quad::MUL3:
+						if (lookup(q.a, x) && q.b->isimm())
+							aff[t] = Affine{x.iv, x.mul*immval(q.b), x.add*immval(q.b)};
+						else if (q.a->isimm() && lookup(q.b, x))
+							aff[t] = Affine{x.iv, x.mul*immval(q.a), x.add*immval(q.a)};
+						break;
+					case Quad::NEG2:
+						if (lookup(q.a, x))
+							aff[t] = Affine{x.iv, -x.mul, -x.add};
+						break;
+					default:
+						break;
+					}
+				}
+			}
+		};
+		// find the basic induction variables: the phis whose value
+		// coming from the back edge is their own plus a constant
+		struct IV {
+			Operand *init; // from the preheader
+			int next; // from the back edge
+			unsigned step;
+		};
+		unordered_map<int, IV> ivs;
+		vector<int> cand, found;
+		for (auto it = h->quads.begin(); it != h->quads.end() && it->op == Quad::PHI; it++)
+			if (it->c->size == 4)
+				cand.push_back(astemp(it->c)->id);
+		analyze(cand);
+		for (auto it = h->quads.begin(); it != h->quads.end() && it->op == Quad::PHI; it++) {
+			int x = astemp(it->c)->id;
+			Affine a;
+			if (it->c->size == 4 && lookup(it->args[jl], a) &&
+			    a.iv == x && a.mul == 1 && a.add != 0)
+			{
+				ivs[x] = IV{it->args[jp], astemp(it->args[jl])->id, a.add};
+				found.push_back(x);
+			}
+		}
+		if (found.empty())
+			continue;
+		if (found.size() != cand.size())
+			analyze(found);
+		// plan the rewrites in terms of new induction variables
+		// r = base+offset+iv*mul, one per key; the offset is that of
+		// the first access, so that r points into the array and stays
+		// clear of signed overflow in the exit test
+		struct Key {
+			int iv;
+			Operand *base;
+			unsigned mul;
+			int offset;
+			vector<int> uses; // blocks addressing memory with r
+			TempOperand *r, *next;
+		};
+		struct Rewrite {
+			Quad *q;
+			Operand **o; // the memory operand, or null for a MUL3
+			int key;
+			unsigned add; // to the offset, or to r for a MUL3
+		};
+		vector<Key> keys;
+		vector<Rewrite> rewrites;
+		auto key = [&](int iv, Operand *base, unsigned mul, int offset) {
+			for (int k=0; k<int(keys.size()); k++)
+				if (keys[k].iv == iv && keys[k].base == base && keys[k].mul == mul)
+					return k;
+			keys.push_back(Key{iv, base, mul, offset, {}, nullptr, nullptr});
+			return int(keys.size())-1;
+		};
+		unordered_set<Quad*> reduced_mul;
+		// operands of quads whose use of a derived value goes away; for
+		// a memory operand, that of its index
+		unordered_set<Operand**> gone;
+		for (int b: body) {
+			for (Quad &q: blocks[b]->quads) {
+				if (q.op == Quad::PHI)
+					continue;
+				Affine x;
+				if (q.op == Quad::MUL3 && compute_def_temp(q) >= 0 &&
+				    (q.a->isimm() || q.b->isimm()) &&
+				    lookup(q.a->isimm() ? q.b : q.a, x))
+				{
+					unsigned c = immval(q.a->isimm() ? q.a : q.b);
+					if (x.mul*c != 0) {
+						rewrites.push_back(Rewrite{&q, nullptr, key(x.iv, nullptr, x.mul*c, 0), x.add*c});
+						reduced_mul.insert(&q);
+						gone.insert(q.a->isimm() ? &q.b : &q.a);
+						continue;
+					}
+				}
+				for (Operand **o: {&q.c, &q.a, &q.b}) {
+					if (!*o || !(*o)->ismem())
+						continue;
+					MemOperand *m = asmem(*o);
+					if (!m->base || !is_invariant(m->base, l, defblock) ||
+					    !lookup(m->index, x) || x.mul*m->scale == 0)
+						continue;
+					int k = key(x.iv, m->base, x.mul*m->scale,
+						    m->offset+int(x.add*m->scale));
+					rewrites.push_back(Rewrite{&q, o, k, x.add*m->scale});
+					if (keys[k].uses.empty() || keys[k].uses.back() != b)
+						keys[k].uses.push_back(b);
+					gone.insert(o);
+				}
+			}
+		}
+		if (keys.empty())
+			continue;
+		// the loop is entered only if cont(init, lim) holds, going by
+		// the nearest branch dominating the preheader
+		auto guarded = [&](Operand *init, Operand *lim, Quad::Op cont) {
+			if (init->isimm() && lim->isimm())
+				return branch_taken(cont, immval(init), immval(lim));
+			for (int d = ph->id; d != 0; d = dt.idom[d]) {
+				const BB *g = blocks[dt.idom[d]].get();
+				if (g->succ.size() < 2)
+					continue;
+				const Quad &q = g->quads.back();
+				Quad::Op op;
+				if (dt.dominates(g->succ[1]->id, d))
+					op = q.op;
+				else if (dt.dominates(g->succ[0]->id, d))
+					op = Quad::negated(q.op);
+				else
+					return false;
+				return (q.a == init && q.b == lim && op == cont) ||
+					(q.a == lim && q.b == init && op == Quad::swapped(cont));
+			}
+			return false;
+		};
+		// exit tests to replace, with the keys to compare
+		struct Test {
+			Quad *q;
+			int key;
+			bool left; // the induction variable is q.a
+		};
+		vector<Test> tests;
+		for (int b: body) {
+			BB *x = blocks[b].get();
+			if (x->quads.empty() || !x->quads.back().isbranch() ||
+			    l.contains(x->succ[0]->id) == l.contains(x->succ[1]->id))
+				continue;
+			Quad &q = x->quads.back();
+			// the loop goes on iff cont(z, lim)
+			Operand *z = q.a, *lim = q.b;
+			Quad::Op cont = l.contains(x->succ[1]->id) ? q.op : Quad::negated(q.op);
+			Affine a;
+			if (!lookup(z, a)) {
+				swap(z, lim);
+				cont = Quad::swapped(cont);
+				if (!lookup(z, a))
+					continue;
+			}
+			const IV &v = ivs[a.iv];
+			if (a.mul != 1 || a.add != v.step || !is_invariant(lim, l, defblock))
+				continue;
+			if (int(v.step) > 0 ? cont != Quad::BLT && cont != Quad::BLE :
+			    cont != Quad::BGT && cont != Quad::BGE)
+				continue;
+			if (!guarded(v.init, lim, cont))
+				continue;
+			for (int k=0; k<int(keys.size()); k++) {
+				if (keys[k].iv == a.iv && keys[k].base &&
+				    any_of(keys[k].uses.begin(), keys[k].uses.end(), [&](int u) {
+					    return dt.dominates(u, b);
+				    }))
+				{
+					tests.push_back(Test{&q, k, q.a == z});
+					gone.insert(q.a == z ? &q.a : &q.b);
+					break;
+				}
+			}
+		}
+		// Only worth it when a basic induction variable dies: its values
+		// and those derived from it (but not through a reduced MUL3) are
+		// then used by nothing else, and the adds and multiplications
+		// computing them outnumber the new variables.  An i only used
+		// as a scaled index stays, as that addressing costs nothing.
+		unordered_map<int, int> saved; // arithmetic quads that go away
+		unordered_set<int> dead; // basic induction variables
+		unordered_map<int, int> family; // temporary -> basic induction variable
+		for (int x: found) {
+			family[x] = x;
+			dead.insert(x);
+		}
+		for (int b: body) {
+			for (Quad &q: blocks[b]->quads) {
+				int t = compute_def_temp(q);
+				if (t < 0 || !aff.count(t) || q.op == Quad::PHI)
+					continue;
+				if (reduced_mul.count(&q)) {
+					saved[aff[t].iv]++;
+					continue;
+				}
+				family[t] = aff[t].iv;
+				// the step of i is not saved: each new variable
+				// needs one of its own
+				if (q.op != Quad::MOV && t != ivs[aff[t].iv].next)
+					saved[aff[t].iv]++;
+			}
+		}
+		auto internal = [&](Quad &q) {
+			int t = compute_def_temp(q);
+			return t >= 0 && q.op != Quad::PHI && family.count(t) && !reduced_mul.count(&q);
+		};
+		for (const unique_ptr<BB> &p: blocks) {
+			for (Quad &q: p->quads) {
+				auto use = [&](Operand *o) {
+					if (!o || !o->istemp())
+						return;
+					auto it = family.find(astemp(o)->id);
+					if (it != family.end())
+						dead.erase(it->second);
+				};
+				if (q.op == Quad::PHI) {
+					for (Operand **a = q.args; *a; a++) {
+						// the back edge value of the basic variable itself
+						if (p.get() == h && a == &q.args[jl] &&
+						    ivs.count(astemp(q.c)->id))
+							continue;
+						use(*a);
+					}
+					continue;
+				}
+				if (internal(q))
+					continue;
+				for (Operand **o: {&q.c, &q.a, &q.b}) {
+					if (!*o)
+						continue;
+					if ((*o)->ismem()) {
+						use(asmem(*o)->base);
+						if (!gone.count(o))
+							use(asmem(*o)->index);
+					} else if (!gone.count(o) && (o != &q.c || compute_def_temp(q) < 0)) {
+						use(*o);
+					}
+				}
+			}
+		}
+		vector<int> nkeys(tempid);
+		for (const Key &k: keys)
+			if (dead.count(k.iv))
+				nkeys[k.iv]++;
+		for (auto it = dead.begin(); it != dead.end(); ) {
+			if (nkeys[*it] > saved[*it])
+				it = dead.erase(it);
+			else
+				it++;
+		}
+		if (dead.empty())
+			continue;
+		// base+offset+v*mul of a key, computed at the end of the
+		// preheader
+		auto scaled = [&](const Key &k, Operand *v) -> Operand * {
+			Operand *base = k.base;
+			unsigned mul = k.mul;
+			if (v->isimm()) {
+				unsigned c = immval(v)*mul;
+				if (!base)
+					return imm(c);
+				TempOperand *t = newtemp_in(ph);
+				ph->quads.emplace_back(Quad::LEA, t, mem(0, base, k.offset+int(c)));
+				return t;
+			}
+			Operand *index = v;
+			int scale = mul;
+			if (mul != 1 && mul != 2 && mul != 4 && mul != 8) {
+				TempOperand *u = newtemp_in(ph);
+				ph->quads.emplace_back(Quad::MUL3, u, v, imm(mul));
+				index = u;
+				scale = 1;
+			}
+			if (!base && scale == 1)
+				return index;
+			TempOperand *t = newtemp_in(ph);
+			ph->quads.emplace_back(Quad::LEA, t, mem(0, base, k.offset, index, scale));
+			return t;
+		};
+		for (Key &k: keys) {
+			if (dead.count(k.iv)) {
+				k.r = newtemp_in(h);
+				nreduced++;
+			}
+		}
+		for (const Rewrite &w: rewrites) {
+			const Key &k = keys[w.key];
+			if (!k.r)
+				continue;
+			Quad &q = *w.q;
+			if (!w.o) {
+				if (w.add)
+					q = Quad(Quad::ADD3, q.c, k.r, imm(w.add));
+				else
+					q = Quad(Quad::MOV, q.c, k.r);
+				continue;
+			}
+			MemOperand *m = asmem(*w.o);
+			*w.o = mem(m->size, k.r, m->offset+int(w.add)-k.offset);
+			if (q.op == Quad::LEA && !asmem(q.a)->offset)
+				q = Quad(Quad::MOV, q.c, k.r);
+		}
+		for (const Test &test: tests) {
+			Key &k = keys[test.key];
+			if (!k.r)
+				continue;
+			Quad &q = *test.q;
+			if (!k.next)
+				k.next = newtemp_in(h);
+			Operand *&lim = test.left ? q.b : q.a;
+			lim = scaled(k, lim);
+			(test.left ? q.a : q.b) = k.next;
+			if (int(k.mul) < 0)
+				q.op = Quad::swapped(q.op);
+		}
+		// r = phi(init, next) in the header, with next = r+step*mul right
+		// after the next value of its basic induction variable
+		for (Key &k: keys) {
+			if (!k.r)
+				continue;
+			const IV &v = ivs[k.iv];
+			Operand **args = arena.make_array<Operand*>(3);
+			args[jp] = scaled(k, v.init);
+			if (!k.next)
+				k.next = newtemp_in(h);
+			args[jl] = k.next;
+			for (int b: body) {
+				vector<Quad> &qs = blocks[b]->quads;
+				auto it = find_if(qs.begin(), qs.end(), [&](const Quad &q) {
+					return compute_def_temp(q) == v.next;
+				});
+				if (it != qs.end()) {
+					defblock[k.next->id] = b;
+					qs.emplace(next(it), Quad::ADD3, k.next, k.r, imm(v.step*k.mul));
+					break;
+				}
+			}
+			h->quads.emplace(h->quads.begin(), Quad::PHI, k.r, args);
+		}
+	}
+}
+
+// Mark-and-sweep dead code elimination over the SSA def-use chains.  The
+// roots are the quads with an effect besides defining a temporary (calls,
+// pushes, stores, branches, writes to physical registers) and divisions
+// that may trap; whatever they do not use, directly or through other
+// live quads and phis, is deleted.
+void TranslateEnv::dce()
+{
+	int n = blocks.size();
+	vector<pair<int,int>> def(tempid, make_pair(-1, -1));
+	vector<vector<char>> live(n);
+	vector<pair<int,int>> work;
+	for (int b=0; b<n; b++) {
+		const vector<Quad> &qs = blocks[b]->quads;
+		live[b].assign(qs.size(), false);
+		for (int i=0; i<int(qs.size()); i++) {
+			const Quad &q = qs[i];
+			int t = compute_def_temp(q);
+			if (t >= 0)
+				def[t] = make_pair(b, i);
+			// INT_MIN/-1 traps as well as a division by 0
+			bool trap = q.op == Quad::DIV3 &&
+				(!q.b->isimm() || static_cast<ImmOperand*>(q.b)->val == 0 ||
+				 static_cast<ImmOperand*>(q.b)->val == -1);
+			if (t < 0 || trap) {
+				live[b][i] = true;
+				work.emplace_back(b, i);
+			}
+		}
+	}
+	auto mark = [&](int a) {
+		if (a < 0)
+			return;
+		int b = def[a].first, i = def[a].second;
+		if (b >= 0 && !live[b][i]) {
+			live[b][i] = true;
+			work.emplace_back(b, i);
+		}
+	};
+	while (!work.empty()) {
+		pair<int,int> u = work.back();
+		work.pop_back();
+		const Quad &q = blocks[u.first]->quads[u.second];
+		if (q.op == Quad::PHI) {
+			for (Operand **p = q.args; *p; p++)
+				if ((*p)->istemp())
+					mark(astemp(*p)->id);
+		} else {
+			for_each_use(q, mark);
+		}
+	}
+	for (int b=0; b<n; b++) {
+		vector<Quad> &qs = blocks[b]->quads;
+		int m = 0;
+		for (int i=0; i<int(qs.size()); i++) {
+			if (live[b][i])
+				qs[m++] = qs[i];
+			else
+				ndead++;
+		}
+		qs.erase(qs.begin()+m, qs.end());
+	}
+}
+
+// Replace the phis with copies at the end of their predecessors, which
+// build_cfg() has made jump straight to the phis' block.  The copies for
+// one edge happen in parallel: since copy propagation, a phi may take the
+// value of another phi of the block (e.g. when a loop swaps two variables),
+// so they are put in an order where no source is overwritten before it is
+// read, going through a new temporary to break cycles.
+void TranslateEnv::from_ssa()
+{
+	// temporaries are compared by id, whatever their size
+	auto same = [](Operand *a, Operand *b) {
+		return a == b || (a->istemp() && b->istemp() && astemp(a)->id == astemp(b)->id);
+	};
+	vector<pair<Operand*,Operand*>> copies; // destination, source
 	for (const unique_ptr<BB> &p: blocks) {
 		BB *bb = p.get();
-		auto it_phi = bb->quads.begin();
-		while (it_phi != bb->quads.end() && it_phi->op == Quad::PHI) {
-			Operand **args = it_phi->args;
-			for (int i=0; args[i]; i++)
-				bb->pred[i]->quads.emplace_back(Quad::MOV, it_phi->c, args[i]);
-			it_phi++;
+		auto end_phi = bb->quads.begin();
+		while (end_phi != bb->quads.end() && end_phi->op == Quad::PHI)
+			end_phi++;
+		for (int i=0; i<int(bb->pred.size()); i++) {
+			copies.clear();
+			for (auto it = bb->quads.begin(); it != end_phi; it++)
+				if (!same(it->c, it->args[i]))
+					copies.emplace_back(it->c, it->args[i]);
+			if (copies.empty())
+				continue;
+			vector<Quad> &qs = bb->pred[i]->quads;
+			assert(bb->pred[i]->succ.size() == 1);
+			auto pos = qs.end();
+			if (!qs.empty() && qs.back().isbranch())
+				pos--;
+			vector<Quad> seq;
+			while (!copies.empty()) {
+				// a copy whose destination no other copy still reads
+				auto ready = find_if(copies.begin(), copies.end(), [&](const pair<Operand*,Operand*> &c) {
+					return none_of(copies.begin(), copies.end(), [&](const pair<Operand*,Operand*> &d) {
+						return &d != &c && same(d.second, c.first);
+					});
+				});
+				if (ready == copies.end()) {
+					// only cycles are left: save one destination first
+					Operand *d = copies[0].first;
+					TempOperand *t = newtemp(d->size);
+					seq.emplace_back(Quad::MOV, t, d);
+					for (pair<Operand*,Operand*> &c: copies) {
+						if (same(c.second, d)) {
+							if (c.second->size < t->size)
+								part_temps.push_back(t->id);
+							c.second = temp(c.second->size, t->id);
+						}
+					}
+					ready = copies.begin();
+				}
+				seq.emplace_back(Quad::MOV, ready->first, ready->second);
+				copies.erase(ready);
+			}
+			qs.insert(pos, seq.begin(), seq.end());
 		}
-		bb->quads.erase(bb->quads.begin(), it_phi);
+		bb->quads.erase(bb->quads.begin(), end_phi);
 	}
-	dump_cfg(procname+"-postssa", blocks);
 }
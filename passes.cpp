@@ -0,0 +1,300 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "translate.h"
+#include "dynbitset.h"
+#include "dataflow.h"
+
+using namespace std;
+
+// Every procedure runs through the pipeline in TranslateOptions::passes.
+// A pass works either on the linear quads or on the CFG (env.blocks); the
+// pass manager converts between the two forms as needed.
+
+struct Pass {
+	const char *name;
+	void (TranslateEnv::*run)();
+	bool cfg; // works on env.blocks
+	bool ssa; // must run between ssa and unssa
+};
+
+static const Pass pass_table[] = {
+	{ "sync",     &TranslateEnv::insert_sync, false, false },
+	{ "ssa",      &TranslateEnv::to_ssa,      true,  false },
+	{ "sccp",     &TranslateEnv::sccp,        true,  true  },
+	{ "gvn",      &TranslateEnv::gvn,         true,  true  },
+	{ "licm",     &TranslateEnv::licm,        true,  true  },
+	{ "ivsr",     &TranslateEnv::reduce_iv,   true,  true  },
+	{ "dce",      &TranslateEnv::dce,         true,  true  },
+	{ "unssa",    &TranslateEnv::from_ssa,    true,  false },
+	{ "lower",    &TranslateEnv::lower,       false, false },
+	{ "regalloc", &TranslateEnv::regalloc,    false, false },
+	{ "peephole", &TranslateEnv::peephole,    false, false },
+	{ "emit",     &TranslateEnv::gencode,     false, false },
+};
+
+static const Pass *find_pass(const string &name)
+{
+	for (const Pass &p: pass_table)
+		if (name == p.name)
+			return &p;
+	return nullptr;
+}
+
+static vector<string> split_names(const char *s)
+{
+	vector<string> names;
+	const char *p = s;
+	for (;;) {
+		const char *q = strchr(p, ',');
+		if (!q) {
+			if (*p)
+				names.emplace_back(p);
+			break;
+		}
+		if (q > p)
+			names.emplace_back(p, q);
+		p = q+1;
+	}
+	return names;
+}
+
+// Fill in opt.passes, from the comma-separated list in passes or, if it
+// is null, from the -O level. The list names the optimizations only:
+// sync is put in front when scalars are tracked (-O), every ssa is closed
+// by an unssa, and lower, regalloc, peephole (at -O) and emit always run
+// last.
+bool setup_pipeline(TranslateOptions &opt, const char *passes)
+{
+	vector<string> names;
+	if (passes) {
+		names = split_names(passes);
+	} else {
+		if (opt.optimize >= 1)
+			names.emplace_back("sync");
+		if (opt.optimize >= 2) {
+			names.emplace_back("ssa");
+			names.emplace_back("sccp");
+			names.emplace_back("gvn");
+			names.emplace_back("licm");
+			// values left for after a loop hold induction variables
+			// alive until dce has removed the unused ones
+			names.emplace_back("dce");
+			names.emplace_back("ivsr");
+			names.emplace_back("dce");
+			names.emplace_back("unssa");
+		}
+	}
+	for (const string &name: names) {
+		if (!find_pass(name)) {
+			fprintf(stderr, "unknown pass: %s\n", name.c_str());
+			return false;
+		}
+		if (name == "lower" || name == "regalloc" || name == "peephole" || name == "emit") {
+			fprintf(stderr, "pass %s always runs last\n", name.c_str());
+			return false;
+		}
+	}
+	opt.passes.clear();
+	// SYNC quads must be gone before anything else looks at the code
+	if (opt.optimize && (names.empty() || names[0] != "sync"))
+		opt.passes.emplace_back("sync");
+	bool in_ssa = false;
+	for (const string &name: names) {
+		if (name == "ssa") {
+			if (in_ssa)
+				opt.passes.emplace_back("unssa");
+			in_ssa = true;
+		} else if (name == "unssa") {
+			if (!in_ssa)
+				continue;
+			in_ssa = false;
+		} else if (find_pass(name)->ssa && !in_ssa) {
+			fprintf(stderr, "pass %s must run between ssa and unssa\n", name.c_str());
+			return false;
+		}
+		opt.passes.push_back(name);
+	}
+	if (in_ssa)
+		opt.passes.emplace_back("unssa");
+	opt.passes.emplace_back("lower");
+	opt.passes.emplace_back("regalloc");
+	if (opt.optimize)
+		opt.passes.emplace_back("peephole");
+	opt.passes.emplace_back("emit");
+	return true;
+}
+
+bool setup_dumps(TranslateOptions &opt, const char *names)
+{
+	for (const string &name: split_names(names)) {
+		if (name != "all" && !find_pass(name)) {
+			fprintf(stderr, "unknown pass: %s\n", name.c_str());
+			return false;
+		}
+		opt.dump_after.push_back(name);
+	}
+	return true;
+}
+
+void TranslateEnv::run_passes()
+{
+	for (const string &name: opt->passes) {
+		const Pass *p = find_pass(name);
+		if (p->cfg && blocks.empty())
+			build_cfg();
+		else if (!p->cfg && !blocks.empty())
+			linearize();
+		(this->*p->run)();
+		for (const string &d: opt->dump_after) {
+			if (d == "all" || d == name) {
+				dump(p->name);
+				break;
+			}
+		}
+	}
+	// the CFG passes' work reached the code only through linearize()
+	assert(blocks.empty());
+}
+
+void TranslateEnv::build_cfg()
+{
+	// a procedure may end with a branch (e.g. a do-while loop); the label
+	// gives its fallthrough edge an empty exit block to go to
+	quads.emplace_back(Quad::LABEL, newlabel());
+	blocks = partition(quads, labelid);
+	// keep the entry out of loops, so that it never needs a phi or a
+	// preheader
+	if (!blocks[0]->pred.empty()) {
+		BB *entry = new BB(0);
+		entry->succ.push_back(blocks[0].get());
+		blocks[0]->pred.push_back(entry);
+		blocks.emplace(blocks.begin(), entry);
+		for (size_t i=0; i<blocks.size(); i++)
+			blocks[i]->id = i;
+	}
+	split_edges(blocks);
+}
+
+// Rebuild quads from the CFG.  Blocks are laid out in reverse postorder,
+// visiting the fallthrough successor last so that it follows its
+// predecessor, as in the code translate_block() emits; blocks left empty
+// (e.g. split edges that got no copies) are jumped over, and blocks not
+// reachable from the entry are dropped.
+void TranslateEnv::linearize()
+{
+	int n = 0;
+	for (const unique_ptr<BB> &p: blocks)
+		n = max(n, p->id+1);
+	auto skip = [&](BB *b) {
+		for (int i=0; i<n && b->quads.empty() && b->succ.size() == 1; i++)
+			b = b->succ[0];
+		return b;
+	};
+	BB *entry = skip(blocks[0].get());
+	vector<BB*> order;
+	vector<char> visited(n);
+	vector<pair<BB*,int>> stack{{entry, 0}};
+	visited[entry->id] = true;
+	while (!stack.empty()) {
+		BB *b = stack.back().first;
+		int &i = stack.back().second;
+		int nsucc = b->succ.size();
+		if (i == nsucc) {
+			order.push_back(b);
+			stack.pop_back();
+			continue;
+		}
+		BB *s = skip(b->succ[nsucc-1-i++]);
+		if (!visited[s->id]) {
+			visited[s->id] = true;
+			stack.emplace_back(s, 0);
+		}
+	}
+	reverse(order.begin(), order.end());
+	// the exit block must come last, there is no jump to the epilogue
+	for (auto it = order.begin(); it != order.end(); it++) {
+		if ((*it)->succ.empty()) {
+			rotate(it, next(it), order.end());
+			break;
+		}
+	}
+	int m = order.size();
+	vector<int> pos(n, -1);
+	for (int i=0; i<m; i++)
+		pos[order[i]->id] = i;
+	// a block only branched to that jumps back to a loop header goes
+	// right before it, e.g. the copies on a back edge: the loop then
+	// takes one branch per iteration, and its entry a jump instead
+	for (int i=1; i<m; i++) {
+		BB *b = order[i], *p = order[i-1];
+		if (b->succ.size() != 1)
+			continue;
+		int h = pos[skip(b->succ[0])->id];
+		if (h <= 0 || h >= i ||
+		    any_of(p->succ.begin(), p->succ.end(), [&](BB *s) { return skip(s) == b; }))
+			continue;
+		rotate(order.begin()+h, order.begin()+i, order.begin()+i+1);
+		for (int j=h; j<=i; j++)
+			pos[order[j]->id] = j;
+	}
+	// choose the jumps ending each block
+	vector<BB*> target(m), jump(m); // of the final branch and jump
+	vector<LabelOperand*> label(n);
+	for (int i=0; i<m; i++) {
+		BB *b = order[i];
+		if (b->succ.empty())
+			continue;
+		BB *f = skip(b->succ[0]);
+		if (!b->quads.empty() && b->quads.back().isbranch()) {
+			BB *t = skip(b->succ[1]);
+			if (t == f) {
+				b->quads.pop_back();
+			} else {
+				if (pos[t->id] == i+1 && pos[f->id] != i+1) {
+					Quad &q = b->quads.back();
+					q.op = Quad::negated(q.op);
+					swap(t, f);
+				}
+				target[i] = t;
+				if (!label[t->id])
+					label[t->id] = newlabel();
+			}
+		}
+		if (pos[f->id] != i+1) {
+			jump[i] = f;
+			if (!label[f->id])
+				label[f->id] = newlabel();
+		}
+	}
+	quads.clear();
+	for (int i=0; i<m; i++) {
+		BB *b = order[i];
+		if (label[b->id])
+			quads.emplace_back(Quad::LABEL, label[b->id]);
+		for (Quad &q: b->quads)
+			quads.push_back(q);
+		if (target[i])
+			quads.back().c = label[target[i]->id];
+		if (jump[i])
+			quads.emplace_back(Quad::JMP, label[jump[i]->id]);
+	}
+	blocks.clear();
+}
+
+// a CFG is written to cfg-<proc>-<pass>.dot (see showcfg), linear quads
+// go to stderr
+void TranslateEnv::dump(const char *pass)
+{
+	if (!blocks.empty()) {
+		dump_cfg(procname+'-'+pass, blocks);
+	} else {
+		fprintf(stderr, "%s after %s:\n", procname.c_str(), pass);
+		dump_quads();
+	}
+}
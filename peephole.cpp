@@ -0,0 +1,249 @@
+#include <cstdint>
+#include <vector>
+#include "translate.h"
+#include "dynbitset.h"
+#include "dataflow.h"
+
+using namespace std;
+
+// Peephole optimization of the quads after register allocation, when each
+// one is an instruction (see gencode()).  A rule looks at the quad at some
+// position, and maybe the next one, and rewrites them in place; at every
+// position the rules are tried in the order of the table until none
+// applies.  Rules never match across a label, which is a quad of its own,
+// though one may look at the label ending its run.
+
+namespace {
+
+struct Peephole {
+	TranslateEnv &env;
+	vector<Quad> &quads;
+	vector<uint8_t> live; // physical registers live after each quad
+	Peephole(TranslateEnv &env): env(env), quads(env.quads) {}
+	void erase(int i)
+	{
+		quads.erase(quads.begin()+i);
+		live.erase(live.begin()+i);
+	}
+	bool dead_after(Operand *r, int i) const
+	{
+		return !(live[i] >> ~astemp(r)->id & 1);
+	}
+};
+
+struct Rule {
+	const char *name;
+	bool (*apply)(Peephole &p, int i);
+};
+
+bool isreg(Operand *o)
+{
+	return o->istemp() && astemp(o)->id < 0;
+}
+
+// whether o reads or writes register r (or a part of it)
+bool mentions(Operand *o, Operand *r)
+{
+	if (o->istemp())
+		return astemp(o)->id == astemp(r)->id;
+	if (o->ismem()) {
+		MemOperand *m = asmem(o);
+		return (m->base && mentions(m->base, r)) || (m->index && mentions(m->index, r));
+	}
+	return false;
+}
+
+bool isaddsub(const Quad &q)
+{
+	return (q.op == Quad::ADD || q.op == Quad::SUB) && q.a->isimm();
+}
+
+int addend(const Quad &q)
+{
+	int v = static_cast<ImmOperand*>(q.a)->val;
+	return q.op == Quad::ADD ? v : int(-unsigned(v));
+}
+
+// add x,c1 / sub x,c2 -> add x,c1-c2, or nothing
+bool fold_add(Peephole &p, int i)
+{
+	if (i+1 == int(p.quads.size()))
+		return false;
+	Quad &q = p.quads[i], &r = p.quads[i+1];
+	if (!isaddsub(q) || !isaddsub(r) || q.c != r.c)
+		return false;
+	// wraps around like the machine add; a signed overflow is undefined
+	int v = int(unsigned(addend(q)) + unsigned(addend(r)));
+	p.erase(i+1);
+	if (v)
+		q = Quad(Quad::ADD, q.c, p.env.imm(v));
+	else
+		p.erase(i);
+	return true;
+}
+
+// mov r,imm / cmp x,r -> cmp x,imm, and the same for add and sub, when
+// nothing else reads r
+bool fold_imm(Peephole &p, int i)
+{
+	if (i+1 == int(p.quads.size()))
+		return false;
+	Quad &q = p.quads[i], &r = p.quads[i+1];
+	if (q.op != Quad::MOV || !isreg(q.c) || !q.a->isimm() || !p.dead_after(q.c, i+1))
+		return false;
+	if (r.isbranch() && r.b) {
+		if (r.b == q.c && !r.a->isimm() && !mentions(r.a, q.c)) {
+			r.b = q.a;
+		} else if (r.a == q.c && !r.b->isimm() && !mentions(r.b, q.c)) {
+			r.a = r.b;
+			r.b = q.a;
+			r.op = Quad::swapped(r.op);
+		} else {
+			return false;
+		}
+	} else if ((r.op == Quad::ADD || r.op == Quad::SUB) && r.a == q.c && !mentions(r.c, q.c)) {
+		r.a = q.a;
+	} else {
+		return false;
+	}
+	p.erase(i);
+	return true;
+}
+
+// add x,1 -> inc x; sub x,1 -> dec x
+bool inc_dec(Peephole &p, int i)
+{
+	Quad &q = p.quads[i];
+	if (!isaddsub(q) || (addend(q) != 1 && addend(q) != -1))
+		return false;
+	q = Quad(addend(q) == 1 ? Quad::INC : Quad::DEC, q.c);
+	return true;
+}
+
+// cmp r,0 -> test r,r
+bool test_zero(Peephole &p, int i)
+{
+	Quad &q = p.quads[i];
+	if (!q.isbranch() || !q.b)
+		return false;
+	auto zero = [](Operand *o) {
+		return o->isimm() && !static_cast<ImmOperand*>(o)->val;
+	};
+	if (isreg(q.a) && zero(q.b)) {
+		q.b = nullptr;
+	} else if (zero(q.a) && isreg(q.b)) {
+		q.a = q.b;
+		q.b = nullptr;
+		q.op = Quad::swapped(q.op);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// mov x,y / mov y,x -> mov x,y, e.g. a load right before a store back to
+// the same spill slot; also a move repeated
+bool redundant_mov(Peephole &p, int i)
+{
+	if (i+1 == int(p.quads.size()))
+		return false;
+	Quad &q = p.quads[i], &r = p.quads[i+1];
+	if (q.op != Quad::MOV || r.op != Quad::MOV)
+		return false;
+	if (!(r.c == q.a && r.a == q.c) && !(r.c == q.c && r.a == q.a))
+		return false;
+	// the move must not change what the operands denote
+	if (isreg(q.c) && mentions(q.a, q.c))
+		return false;
+	p.erase(i+1);
+	return true;
+}
+
+// jcc L1 / jmp L2 / L1: -> jncc L2 / L1:, as left by a loop whose exit
+// test ends up last; the label stays for the other jumps to it
+bool straighten(Peephole &p, int i)
+{
+	if (i+2 >= int(p.quads.size()))
+		return false;
+	Quad &q = p.quads[i], &r = p.quads[i+1], &l = p.quads[i+2];
+	if (!q.isbranch() || !r.isjump() || l.op != Quad::LABEL || q.c != l.c)
+		return false;
+	q.op = Quad::negated(q.op);
+	q.c = r.c;
+	p.erase(i+1);
+	return true;
+}
+
+// mov r,0 -> xor r,r
+bool xor_zero(Peephole &p, int i)
+{
+	Quad &q = p.quads[i];
+	if (q.op != Quad::MOV || !isreg(q.c) || !q.a->isimm() || static_cast<ImmOperand*>(q.a)->val)
+		return false;
+	q = Quad(Quad::XOR, q.c, q.c);
+	return true;
+}
+
+const Rule rules[] = {
+	{ "redundant-mov", redundant_mov },
+	{ "fold-add",      fold_add      },
+	{ "fold-imm",      fold_imm      },
+	{ "inc-dec",       inc_dec       },
+	{ "test-zero",     test_zero     },
+	{ "xor-zero",      xor_zero      },
+	{ "straighten",    straighten    },
+};
+
+}
+
+void TranslateEnv::peephole()
+{
+	Peephole p(*this);
+	Liveness lv;
+	lv.build(quads, labelid, tempid);
+	lv.solve();
+	p.live.resize(quads.size());
+	for (int b=0; b<lv.nblock(); b++) {
+		uint8_t live = 0;
+		for (int r=0; r<8; r++)
+			if (lv.out[b].get(8+~r))
+				live |= 1<<r;
+		for (int i=lv.start[b+1]-1; i>=lv.start[b]; i--) {
+			p.live[i] = live;
+			for_each_def(quads[i], [&](int id) {
+				if (id < 0)
+					live &= ~(1<<~id);
+			});
+			for_each_use(quads[i], [&](int id) {
+				if (id < 0)
+					live |= 1<<~id;
+			});
+		}
+	}
+	const int nrule = sizeof rules / sizeof rules[0];
+	vector<int> hits(nrule);
+	for (int i=0; i<int(quads.size()); ) {
+		// a move coalesced away counts as such, not as a rule hit; it
+		// goes only now, as the final one keeps the result in eax live
+		if (quads[i].op == Quad::MOV && quads[i].c == quads[i].a) {
+			p.erase(i);
+			nmove_removed++;
+			if (i)
+				i--;
+			continue;
+		}
+		int k;
+		for (k=0; k<nrule && !rules[k].apply(p, i); k++);
+		if (k == nrule) {
+			i++;
+			continue;
+		}
+		hits[k]++;
+		// the rewrite may have made a pattern with the quad before
+		if (i)
+			i--;
+	}
+	peephole_hits.clear();
+	for (int k=0; k<nrule; k++)
+		peephole_hits.emplace_back(rules[k].name, hits[k]);
+}
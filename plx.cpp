@@ -1,9 +1,13 @@
+#include <cctype>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
+#include <getopt.h>
 #include <unistd.h>
 
 extern "C" {
@@ -17,7 +21,7 @@ using namespace std;
 
 void usage()
 {
-	fputs("usage: ...\n", stderr);
+	fputs("usage: plx [-O]... [-s] [-inline-limit=<n>] [-fregparm] [-passes=<pass>,...] [-dump-after=<pass>,...] [-o <output>] <source>\n", stderr);
 	exit(2);
 }
 
@@ -28,7 +32,15 @@ int main(int argc, char **argv)
 {
 	int opt;
 	TranslateOptions tropt;
-	while ((opt = getopt(argc, argv, "o:O")) != -1) {
+	const char *passes = nullptr;
+	static const struct option longopts[] = {
+		{ "passes",     required_argument, nullptr, 'p' },
+		{ "dump-after", required_argument, nullptr, 'd' },
+		{ "inline-limit", required_argument, nullptr, 'i' },
+		{ "fregparm",   no_argument,       nullptr, 'r' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+	while ((opt = getopt_long_only(argc, argv, "o:Os", longopts, nullptr)) != -1) {
 		switch (opt) {
 		case 'o':
 			tropt.out_fname = optarg;
@@ -36,12 +48,38 @@ int main(int argc, char **argv)
 		case 'O':
 			tropt.optimize++;
 			break;
+		case 's':
+			tropt.stats = true;
+			break;
+		case 'p':
+			passes = optarg;
+			break;
+		case 'd':
+			if (!setup_dumps(tropt, optarg))
+				return 2;
+			break;
+		case 'i':
+			{
+				char *end;
+				long n = strtol(optarg, &end, 10);
+				if (!isdigit((unsigned char) *optarg) || *end || n > INT_MAX) {
+					fprintf(stderr, "invalid inline limit: %s\n", optarg);
+					return 2;
+				}
+				tropt.inline_limit = n;
+			}
+			break;
+		case 'r':
+			tropt.regparm = true;
+			break;
 		default:
 			usage();
 		}
 	}
 	if (optind != argc-1)
 		usage();
+	if (!setup_pipeline(tropt, passes))
+		return 2;
 	lexer_open(argv[optind]);
 	unique_ptr<Block> blk = parse();
 	if (parser_errors)
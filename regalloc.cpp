@@ -1,8 +1,10 @@
 #include <cassert>
 #include <cstdio>
 #include <memory>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 #include "translate.h"
 #include "dynbitset.h"
@@ -10,44 +12,256 @@
 
 using namespace std;
 
-vector<int> color_graph(Graph &&g)
+// Iterated register coalescing (George and Appel): nodes of degree < k
+// that are not involved in moves are simplified first; moves are coalesced
+// conservatively (George's test against a physical register, Briggs's or
+// George's between temporaries) and retried whenever a degree drops below
+// k; when neither applies, the moves of a low-degree node are frozen, and
+// failing that the node of least cost/degree is removed as a spill
+// candidate and still colored optimistically in the select phase.
+// regs has a bit for each register that may be given out: eax ecx edx ebx
+// esi edi, and ebp too when the frame is addressed off esp.
+// free_spill, if given, marks the nodes whose spilling adds no quads (see
+// spill_costs()).
+vector<int> color_graph(Graph &&g, const vector<float> &cost,
+			const vector<pair<int,int>> &moves, unsigned char regs,
+			const vector<char> *free_spill)
 {
-	constexpr int k=6; // eax ecx edx; ebx esi edi
+	int k = 0;
+	for (int i=0; i<8; i++)
+		k += regs >> i & 1;
 	int ntemp = g.ntemp();
 	vector<int> color(ntemp, -1);
 	vector<int> removed;
 	removed.reserve(ntemp);
-	bool removed_p[ntemp] = {};
-	vector<vector<int>> neighbors(ntemp);
-	auto remove_node = [&](int i) {
-		assert(!removed_p[i]);
-		neighbors[i] = g.remove(i);
-		removed.push_back(i);
-		removed_p[i] = true;
+
+	enum { SIMPLIFY, FREEZE, SPILL, COALESCED, REMOVED };
+	vector<char> where(ntemp);
+	vector<int> simplify; // degree < k, no moves
+	vector<int> freeze; // degree < k, move related; may hold stale entries
+	// spill candidates keyed by cost/degree; a key grows as neighbors are
+	// removed, so a stale entry is pushed back with its current key, and
+	// when a merge lowers it the node is pushed again at once
+	typedef pair<float, int> Cand;
+	priority_queue<Cand, vector<Cand>, greater<Cand>> spill;
+	vector<float> weight(cost);
+	vector<char> free_node = free_spill ? *free_spill : vector<char>(ntemp);
+	auto spill_key = [&](int i) {
+		return weight[i]/g.degree(i);
+	};
+
+	enum { WORKLIST, ACTIVE, DONE };
+	vector<char> move_state(moves.size(), WORKLIST);
+	vector<int> worklist; // moves to try
+	vector<vector<int>> move_list(ntemp);
+	for (int m=moves.size()-1; m>=0; m--) {
+		worklist.push_back(m);
+		for (int t: {moves[m].first, moves[m].second}) {
+			if (t >= 0)
+				move_list[t].push_back(m);
+		}
+	}
+	// coalesced temporaries; alias[v] is the node v was merged into, which
+	// may be a physical register
+	vector<int> alias(ntemp);
+	for (int i=0; i<ntemp; i++)
+		alias[i] = i;
+	auto find = [&](int v) {
+		while (v >= 0 && alias[v] != v)
+			v = alias[v];
+		return v;
+	};
+	auto move_related = [&](int v) {
+		for (int m: move_list[v]) {
+			if (move_state[m] != DONE)
+				return true;
+		}
+		return false;
+	};
+	auto classify = [&](int v) {
+		if (g.degree(v) >= k) {
+			where[v] = SPILL;
+			spill.emplace(spill_key(v), v);
+		} else if (move_related(v)) {
+			where[v] = FREEZE;
+			freeze.push_back(v);
+		} else {
+			where[v] = SIMPLIFY;
+			simplify.push_back(v);
+		}
 	};
-	function<void()> remove_nodes = [&]() {
-		for (int i=0; i<ntemp; i++) {
-			int n = g.neighbors(i).size();
-			if (!removed_p[i] && n<k) {
-				remove_node(i);
-				return remove_nodes();
+	for (int i=ntemp-1; i>=0; i--)
+		classify(i);
+	auto enable_moves = [&](int v) {
+		for (int m: move_list[v]) {
+			if (move_state[m] == ACTIVE) {
+				move_state[m] = WORKLIST;
+				worklist.push_back(m);
 			}
 		}
-		// no nodes with degree < k
-		for (int i=0; i<ntemp; i++) {
-			if (!removed_p[i]) {
-				remove_node(i);
-				return remove_nodes();
+	};
+	// the neighbors of a node that has just left the graph lost an edge
+	auto lower_neighbors = [&](int v) {
+		for (int a: g.neighbors(v)) {
+			if (a < 0 || g.removed(a) || g.degree(a) != k-1)
+				continue;
+			enable_moves(a);
+			for (int b: g.neighbors(a)) {
+				if (b >= 0 && !g.removed(b))
+					enable_moves(b);
+			}
+			if (where[a] == SPILL)
+				classify(a);
+		}
+	};
+	auto try_simplify = [&](int v) {
+		if (v >= 0 && where[v] == FREEZE && !move_related(v) && g.degree(v) < k) {
+			where[v] = SIMPLIFY;
+			simplify.push_back(v);
+		}
+	};
+	auto freeze_moves = [&](int v) {
+		for (int m: move_list[v]) {
+			if (move_state[m] == DONE)
+				continue;
+			move_state[m] = DONE;
+			int a = find(moves[m].first);
+			int b = find(moves[m].second);
+			try_simplify(a == find(v) ? b : a);
+		}
+	};
+	vector<int> mark(8+ntemp);
+	int stamp = 0;
+	// Briggs: the merged node has fewer than k neighbors of degree >= k
+	auto briggs = [&](int u, int v) {
+		stamp++;
+		int n = 0;
+		for (int w: {u, v}) {
+			for (int a: g.neighbors(w)) {
+				if (g.removed(a) || mark[8+a] == stamp)
+					continue;
+				mark[8+a] = stamp;
+				// a loses one edge if it is adjacent to both
+				if (a < 0 || g.degree(a) - (g.interferes(a, u) && g.interferes(a, v)) >= k)
+					n++;
 			}
 		}
+		return n < k;
 	};
-	remove_nodes();
-	assert(removed.size() == size_t(ntemp));
+	// George: every neighbor of v already interferes with r or is
+	// insignificant; a physical register is significant unless r is one too
+	auto george = [&](int r, int v) {
+		for (int a: g.neighbors(v)) {
+			if (g.removed(a) || g.interferes(a, r))
+				continue;
+			if (a < 0 ? r >= 0 : g.degree(a) >= k)
+				return false;
+		}
+		return true;
+	};
+	int ncoalesced = 0;
+	auto coalesce = [&](int m) {
+		int u = find(moves[m].first);
+		int v = find(moves[m].second);
+		if (v < 0)
+			swap(u, v);
+		if (u == v) {
+			move_state[m] = DONE;
+			try_simplify(u);
+			return;
+		}
+		if (v < 0 || g.interferes(u, v) || (u < 0 && !(regs >> ~u & 1))) {
+			// constrained
+			move_state[m] = DONE;
+			try_simplify(u);
+			try_simplify(v);
+			return;
+		}
+		if (u >= 0 && !briggs(u, v) && !george(u, v) && george(v, u))
+			swap(u, v);
+		if (u < 0 ? !george(u, v) : !briggs(u, v) && !george(u, v)) {
+			move_state[m] = ACTIVE;
+			return;
+		}
+		move_state[m] = DONE;
+#ifdef DEBUG
+		fprintf(stderr, "coalesce %d into %d\n", v, u);
+#endif
+		// merge v into u
+		for (int a: g.neighbors(v)) {
+			if (g.removed(a) || a == u || g.interferes(u, a))
+				continue;
+			g.connect(u, a);
+			if (a >= 0 && where[a] == SPILL)
+				spill.emplace(spill_key(a), a);
+		}
+		g.remove(v);
+		where[v] = COALESCED;
+		alias[v] = u;
+		ncoalesced++;
+		lower_neighbors(v);
+		if (u >= 0) {
+			weight[u] += weight[v];
+			free_node[u] = free_node[u] && free_node[v];
+			move_list[u].insert(move_list[u].end(), move_list[v].begin(), move_list[v].end());
+			if (where[u] == SPILL)
+				spill.emplace(spill_key(u), u);
+			else if (g.degree(u) >= k)
+				classify(u);
+			else
+				try_simplify(u);
+		}
+	};
+	for (;;) {
+		if (!simplify.empty()) {
+			int v = simplify.back();
+			simplify.pop_back();
+			g.remove(v);
+			where[v] = REMOVED;
+			removed.push_back(v);
+			lower_neighbors(v);
+		} else if (!worklist.empty()) {
+			int m = worklist.back();
+			worklist.pop_back();
+			coalesce(m);
+		} else if (!freeze.empty()) {
+			int v = freeze.back();
+			freeze.pop_back();
+			if (where[v] != FREEZE)
+				continue;
+			where[v] = SIMPLIFY;
+			simplify.push_back(v);
+			freeze_moves(v);
+		} else if (!spill.empty()) {
+			// no nodes with degree < k
+			Cand c = spill.top();
+			spill.pop();
+			int v = c.second;
+			if (where[v] != SPILL)
+				continue;
+			if (c.first != spill_key(v)) {
+				spill.emplace(spill_key(v), v);
+				continue;
+			}
+#ifdef DEBUG
+			fprintf(stderr, "spill candidate: %d (cost %g, degree %d)\n", v, weight[v], g.degree(v));
+#endif
+			where[v] = SIMPLIFY;
+			simplify.push_back(v);
+			freeze_moves(v);
+		} else {
+			break;
+		}
+	}
+	assert(removed.size() == size_t(ntemp-ncoalesced));
 	while (!removed.empty()) {
 		int t = removed.back();
 		removed.pop_back();
-		unsigned char f = 0x30; // 8 bits for 8 regs
-		for (int a: neighbors[t]) {
+		unsigned char f = ~regs; // 8 bits for 8 regs
+		// neighbors removed before t are not colored yet; a neighbor that
+		// was coalesced takes the color of the node it was merged into
+		for (int a: g.neighbors(t)) {
+			a = find(a);
 			if (a<0)
 				f |= 1<<~a;
 			else if (color[a] >= 0)
@@ -63,5 +277,22 @@ vector<int> color_graph(Graph &&g)
 		fprintf(stderr, "color[%d] = %d\n", t, color[t]);
 #endif
 	}
+	// a callee-saved register (ebx, ebp, esi or edi) costs a push and a
+	// pop, not worth it for a single node that is free to spill and used
+	// less than that
+	vector<int> owner(8, -1);
+	for (int i=0; i<ntemp; i++) {
+		int c = color[i];
+		if (find(i) == i && c >= 0 && (0xe8 >> c & 1))
+			owner[c] = owner[c] == -1 && free_node[i] && weight[i] < 2 ? i : -2;
+	}
+	for (int c=0; c<8; c++)
+		if (owner[c] >= 0)
+			color[owner[c]] = -1;
+	for (int i=0; i<ntemp; i++) {
+		int u = find(i);
+		if (u != i)
+			color[i] = u < 0 ? ~u : color[u];
+	}
 	return color;
 };
@@ -120,6 +120,7 @@ struct ProcSymbol: Symbol
 	std::vector<Param> params;
 	Type *rettype;
 	std::string decorated_name;
+	bool regparm = false; // takes args and the static link in registers (see translate_call())
 	ProcSymbol(const std::string &name, ProcSymbol *up, const std::vector<Param> &params, Type *rettype):
 		Symbol(PROC, name, nullptr, up ? up->level+1 : 1),
 		params(params),
@@ -305,6 +306,7 @@ struct Stmt {
 		ASSIGN,
 		CALL,
 		IF,
+		WHILE,
 		DO_WHILE,
 		FOR,
 		READ,
@@ -0,0 +1,34 @@
+enum {
+	BECOMES = 256,
+	LE = 257,
+	GE = 258,
+	NE = 259,
+	INT = 260,
+	CHAR = 261,
+	STRING = 262,
+	IDENT = 263,
+	T_AND = 264,
+	T_ARRAY = 265,
+	T_BEGIN = 266,
+	T_CHAR = 267,
+	T_CONST = 268,
+	T_DO = 269,
+	T_DOWNTO = 270,
+	T_ELSE = 271,
+	T_END = 272,
+	T_FOR = 273,
+	T_FUNCTION = 274,
+	T_IF = 275,
+	T_INTEGER = 276,
+	T_NOT = 277,
+	T_OF = 278,
+	T_OR = 279,
+	T_PROCEDURE = 280,
+	T_READ = 281,
+	T_THEN = 282,
+	T_TO = 283,
+	T_VAR = 284,
+	T_WHILE = 285,
+	T_WRITE = 286,
+};
+extern const char *tokname[31];
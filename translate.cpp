@@ -1,15 +1,20 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "semant.h"
+#include "arena.h"
 #include "translate.h"
 #include "dynbitset.h"
+#include "dataflow.h"
 
 using namespace std;
 
@@ -90,6 +95,19 @@ TempOperand *getphysreg(int size, int id)
 	assert(0);
 }
 
+// With -fregparm, a call passes its first args in eax, edx and ecx, except
+// that a nested procedure takes the innermost static link in ecx and so
+// only two args in registers; the rest go on the stack as usual.  main()
+// and the C library are called the usual way.
+static const int regparm_reg[] = { 0, 2, 1 };
+
+static int regparm_nargs(const ProcSymbol *proc)
+{
+	if (!proc->regparm)
+		return 0;
+	return min(int(proc->params.size()), proc->level > 1 ? 2 : 3);
+}
+
 #if 0
 TempOperand *al = &physreg[8];
 TempOperand *cl = &physreg[9];
@@ -133,6 +151,21 @@ std::string Quad::tostr() const
 	case Quad::DIVB:
 		ss << "divb " << c->tostr();
 		break;
+	case Quad::XOR:
+		ss << c->tostr() << " ^= " << a->tostr();
+		break;
+	case Quad::SHL:
+		ss << c->tostr() << " <<= " << a->tostr();
+		break;
+	case Quad::SAR:
+		ss << c->tostr() << " >>= " << a->tostr();
+		break;
+	case Quad::SHR:
+		ss << c->tostr() << " >>>= " << a->tostr();
+		break;
+	case Quad::MULL:
+		ss << "mull " << c->tostr();
+		break;
 	case Quad::NEG:
 		ss << "neg " << c->tostr();
 		break;
@@ -149,10 +182,18 @@ std::string Quad::tostr() const
 	case Quad::BGT:
 	case Quad::BLE:
 		ss << "goto " << c->tostr() << " if " << a->tostr()
-			<< ' ' << opstr[op] << ' ' << b->tostr();
+			<< ' ' << opstr[op] << ' ' << (b ? b->tostr() : "0");
 		break;
 	case Quad::CALL:
-		ss << "call " << c->tostr();
+	case Quad::TAILJMP:
+		ss << (op == CALL ? "call " : "tail call ") << c->tostr();
+		// args in registers
+		if (a) {
+			int regs = static_cast<ImmOperand*>(a)->val;
+			for (int r=0; r<8; r++)
+				if (regs >> r & 1)
+					ss << ' ' << getphysreg(4, r)->tostr();
+		}
 		break;
 	case Quad::LABEL:
 		ss << c->tostr() << ':';
@@ -208,6 +249,46 @@ std::string Quad::tostr() const
 	return ss.str();
 }
 
+static long long temp_key(int size, int id)
+{
+	return (long long) id << 8 | size;
+}
+
+ImmOperand *TranslateEnv::imm(int val, int size)
+{
+	// shift the bits of val, not its sign: << on a negative int is undefined
+	ImmOperand *&i = imm_table[(long long) uint32_t(val) << 8 | size];
+	if (!i)
+		i = arena.make<ImmOperand>(val, size);
+	return i;
+}
+
+TempOperand *TranslateEnv::temp(int size, int id)
+{
+	if (id < 0)
+		return getphysreg(size, ~id);
+	TempOperand *&t = temp_table[temp_key(size, id)];
+	if (!t)
+		t = arena.make<TempOperand>(size, id);
+	return t;
+}
+
+LabelOperand *TranslateEnv::label(const std::string &name)
+{
+	LabelOperand *&l = label_table[name];
+	if (!l)
+		l = arena.make<LabelOperand>(name);
+	return l;
+}
+
+MemOperand *TranslateEnv::mem(int size, Operand *base, int offset, Operand *index, int scale)
+{
+	MemOperand *&m = mem_table[MemKey{size, base, offset, index, scale}];
+	if (!m)
+		m = arena.make<MemOperand>(size, base, offset, index, scale);
+	return m;
+}
+
 TempOperand *TranslateEnv::newtemp(int size)
 {
 	return newtemp_scalar(size, -1);
@@ -219,7 +300,7 @@ TempOperand *TranslateEnv::newtemp_scalar(int size, int scalar)
 	assert(int(temp_scalar.size()) == tempid);
 	if (size < 4)
 		part_temps.push_back(tempid);
-	TempOperand *t = new TempOperand(size, tempid++);
+	TempOperand *t = temp(size, tempid++);
 	temps.push_back(t);
 	temp_scalar.push_back(scalar);
 	return t;
@@ -227,9 +308,7 @@ TempOperand *TranslateEnv::newtemp_scalar(int size, int scalar)
 
 LabelOperand *TranslateEnv::newlabel()
 {
-	char tmp[16];
-	sprintf(tmp, ".l%d", labelid++);
-	return new LabelOperand(tmp);
+	return arena.make<LabelOperand>(labelid++);
 }
 
 #if 0
@@ -266,51 +345,49 @@ Operand *TranslateEnv::resize(int size, Operand *o)
 	// shrink the operand
 	switch (o->kind) {
 	case Operand::IMM:
-		{
-			ImmOperand *i = new ImmOperand(*static_cast<ImmOperand*>(o));
-			i->size = size;
-			i->val &= (1 << size*8)-1;
-			return i;
-		}
+		return imm(static_cast<ImmOperand*>(o)->val & ((1 << size*8)-1), size);
 	case Operand::TEMP:
 		{
 			int id = astemp(o)->id;
 			part_temps.push_back(id);
-			TempOperand *t = new TempOperand(size, id);
-			t->size = size;
-			return t;
+			return temp(size, id);
 		}
 	case Operand::MEM:
 		{
-			MemOperand *m = new MemOperand(*static_cast<MemOperand*>(o));
-			m->size = size;
-			return m;
+			MemOperand *m = asmem(o);
+			return mem(size, m->base, m->offset, m->index, m->scale);
 		}
 	default:
 		assert(0);
 	}
 }
 
+// The frame of level i, this one or an enclosing one, going by the static
+// links the caller pushed, the innermost at ebp+8; or copied from ecx to a
+// temporary (see translate_block()).
+Operand *TranslateEnv::display(int i)
+{
+	if (i == level)
+		return ebp;
+	if (link && i == level-1)
+		return link;
+	return mem(4, ebp, 8+4*(level-i-1-(link != nullptr)));
+}
+
 MemOperand *TranslateEnv::translate_varsym(const VarSymbol *vs)
 {
 	MemOperand *m;
 	int size = vs->type->size();
 	if (vs->level) {
 		// local var
-		Operand *bp;
-		if (vs->level == level) {
-			bp = ebp;
-		} else {
-			bp = new MemOperand(4, ebp, 8+4*(level-vs->level-1));
-		}
-		m = new MemOperand(vs->isref ? 4 : size, bp, vs->offset);
+		m = mem(vs->isref ? 4 : size, display(vs->level), vs->offset);
 		if (vs->isref) {
 			// m is a pointer
-			m = new MemOperand(size, m);
+			m = mem(size, m);
 		}
 	} else {
 		// global var
-		m = new MemOperand(size, new LabelOperand('$'+vs->name));
+		m = mem(size, label('$'+vs->name));
 	}
 	return m;
 }
@@ -319,11 +396,20 @@ MemOperand *TranslateEnv::translate_lvalue(const Expr *e)
 {
 	Operand *o;
 	const SymExpr *se;
+	VarSymbol *vs;
 	switch (e->kind) {
 	case Expr::SYM:
 		se = static_cast<const SymExpr*>(e);
 		assert(se->sym->kind == Symbol::VAR);
-		return translate_varsym(static_cast<const VarSymbol*>(se->sym));
+		vs = static_cast<VarSymbol*>(se->sym);
+		if (vs->level && !vs->offset) {
+			// a param passed in a register, given its slot only now
+			// that it is read or passed by reference (see allocaddr())
+			assert(vs->level == level);
+			vs->offset = (-framesize-4) & ~3;
+			framesize = -vs->offset;
+		}
+		return translate_varsym(vs);
 	case Expr::INDEX:
 		o = e->translate(*this);
 		assert(o->ismem());
@@ -337,6 +423,9 @@ Operand *TranslateEnv::translate_sym(const Symbol *sym)
 {
 	if (sym->kind == Symbol::VAR) {
 		const VarSymbol *vs = static_cast<const VarSymbol*>(sym);
+		auto it = inline_vars.find(vs);
+		if (it != inline_vars.end())
+			return it->second;
 		if (opt->optimize) {
 			if (vs->type->is_scalar()) {
 				int sid = vs->scalar_id;
@@ -348,19 +437,372 @@ Operand *TranslateEnv::translate_sym(const Symbol *sym)
 	}
 	if (sym->kind == Symbol::PROC) {
 		// address of function
-		return new LabelOperand(static_cast<const ProcSymbol*>(sym)->decorated_name);
+		return label(static_cast<const ProcSymbol*>(sym)->decorated_name);
 	}
 	assert(sym->kind == Symbol::CONST);
-	return new ImmOperand(static_cast<const ConstSymbol*>(sym)->val);
+	return imm(static_cast<const ConstSymbol*>(sym)->val);
+}
+
+// Leaf procedures are inlined at -O2 when their body is small enough.
+// The body is translated again in the caller: params and locals become
+// temporaries, a byref param denotes the caller's lvalue itself, and
+// variables of enclosing procedures are reached from the caller, which
+// sees all of them as well.
+
+static unordered_map<const ProcSymbol*, const Block*> proc_blocks;
+
+namespace {
+
+// size of a body, and why it cannot be inlined
+struct InlineScan {
+	int size = 0;
+	const char *why = nullptr;
+	void expr(const Expr *e);
+	void cond(const Cond *c);
+	void stmt(const Stmt *s);
+};
+
+void InlineScan::expr(const Expr *e)
+{
+	size++;
+	switch (e->kind) {
+	case Expr::SYM:
+	case Expr::LIT:
+		break;
+	case Expr::BINARY:
+		expr(static_cast<const BinaryExpr*>(e)->left.get());
+		expr(static_cast<const BinaryExpr*>(e)->right.get());
+		break;
+	case Expr::UNARY:
+		expr(static_cast<const UnaryExpr*>(e)->sub.get());
+		break;
+	case Expr::INDEX:
+		expr(static_cast<const IndexExpr*>(e)->array.get());
+		expr(static_cast<const IndexExpr*>(e)->index.get());
+		break;
+	case Expr::APPLY:
+		why = "not a leaf";
+		break;
+	}
+}
+
+void InlineScan::cond(const Cond *c)
+{
+	size++;
+	switch (c->kind) {
+	case Cond::SIMPLE:
+		expr(static_cast<const SimpleCond*>(c)->left.get());
+		expr(static_cast<const SimpleCond*>(c)->right.get());
+		break;
+	case Cond::COMP:
+		cond(static_cast<const CompCond*>(c)->left.get());
+		cond(static_cast<const CompCond*>(c)->right.get());
+		break;
+	case Cond::NEG:
+		cond(static_cast<const NegCond*>(c)->sub.get());
+		break;
+	}
+}
+
+void InlineScan::stmt(const Stmt *s)
+{
+	size++;
+	switch (s->kind) {
+	case Stmt::EMPTY:
+		break;
+	case Stmt::COMP:
+		for (const unique_ptr<Stmt> &t: static_cast<const CompStmt*>(s)->body)
+			stmt(t.get());
+		break;
+	case Stmt::ASSIGN:
+		expr(static_cast<const AssignStmt*>(s)->var.get());
+		expr(static_cast<const AssignStmt*>(s)->val.get());
+		break;
+	case Stmt::CALL:
+		why = "not a leaf";
+		break;
+	case Stmt::IF:
+		{
+			const IfStmt *t = static_cast<const IfStmt*>(s);
+			cond(t->cond.get());
+			stmt(t->st.get());
+			if (t->sf)
+				stmt(t->sf.get());
+		}
+		break;
+	case Stmt::WHILE:
+		cond(static_cast<const WhileStmt*>(s)->cond.get());
+		stmt(static_cast<const WhileStmt*>(s)->body.get());
+		break;
+	case Stmt::DO_WHILE:
+		cond(static_cast<const DoWhileStmt*>(s)->cond.get());
+		stmt(static_cast<const DoWhileStmt*>(s)->body.get());
+		break;
+	case Stmt::FOR:
+		{
+			const ForStmt *t = static_cast<const ForStmt*>(s);
+			expr(t->indvar.get());
+			expr(t->from.get());
+			expr(t->to.get());
+			stmt(t->body.get());
+		}
+		break;
+	case Stmt::READ:
+		// scanf needs the variables in memory
+		why = "reads input";
+		break;
+	case Stmt::WRITE:
+		if (static_cast<const WriteStmt*>(s)->val)
+			expr(static_cast<const WriteStmt*>(s)->val.get());
+		break;
+	}
+}
+
+InlineScan scan_callee(const Block &blk, int limit)
+{
+	InlineScan scan;
+	for (const unique_ptr<Stmt> &s: blk.stmts)
+		scan.stmt(s.get());
+	for (const vector<VarSymbol*> *v: {&blk.params, &blk.vars})
+		for (VarSymbol *vs: *v)
+			if (!vs->type->is_scalar())
+				scan.why = "has array variables";
+	if (!scan.why && scan.size > limit)
+		scan.why = "too large";
+	return scan;
+}
+
+}
+
+bool TranslateEnv::inline_call(ProcSymbol *proc, const vector<unique_ptr<Expr>> &args, Operand *&result)
+{
+	if (opt->optimize < 2 || opt->inline_limit <= 0)
+		return false;
+	const Block &blk = *proc_blocks.at(proc);
+	InlineScan scan = scan_callee(blk, opt->inline_limit);
+	ostringstream line;
+	line << "call to " << proc->name;
+	if (scan.why) {
+		line << " not inlined: " << scan.why;
+		inline_log.push_back(line.str());
+		return false;
+	}
+	line << " inlined, " << scan.size << " nodes";
+	inline_log.push_back(line.str());
+	// A byref param of this procedure passed on keeps pointing to the
+	// variable it did, which the body may also see by another name, so
+	// what a call would write back and load again is synced around the
+	// body.
+	bool aliasing = false;
+	for (size_t i=0; i<args.size(); i++) {
+		const Expr *arg = args[i].get();
+		if (proc->params[i].byref && arg->kind == Expr::SYM &&
+		    static_cast<const VarSymbol*>(static_cast<const SymExpr*>(arg)->sym)->isref)
+			aliasing = true;
+	}
+	if (aliasing)
+		sync(Quad::SYNCM);
+	unordered_map<const VarSymbol*, Operand*> vars;
+	// arguments are evaluated right to left, as for a call
+	for (int i=int(args.size())-1; i>=0; i--) {
+		Expr *arg = args[i].get();
+		VarSymbol *param = blk.params[i];
+		if (proc->params[i].byref) {
+			if (arg->kind == Expr::SYM) {
+				vars[param] = arg->translate(*this);
+				continue;
+			}
+			// the element is chosen now, even if the body changes the
+			// variables in the index
+			MemOperand *m = translate_lvalue(arg);
+			Operand *index = m->index;
+			if (index && index->istemp()) {
+				index = newtemp(4);
+				quads.emplace_back(Quad::MOV, index, m->index);
+			}
+			vars[param] = mem(m->size, m->base, m->offset, index, m->scale);
+		} else {
+			TempOperand *t = newtemp(param->type->size());
+			quads.emplace_back(Quad::MOV, t, resize(t->size, arg->translate(*this)));
+			vars[param] = t;
+		}
+	}
+	for (VarSymbol *vs: blk.vars)
+		vars[vs] = newtemp(vs->type->size());
+	if (proc->rettype)
+		result = vars.at(static_cast<VarSymbol*>(blk.symtab->lookup(proc->name+'$')));
+	else
+		result = nullptr;
+	// the callee's own symbol table resolves its result variable
+	SymbolTable *caller_symtab = symtab;
+	symtab = blk.symtab;
+	swap(inline_vars, vars);
+	for (const unique_ptr<Stmt> &s: blk.stmts)
+		s->translate(*this);
+	swap(inline_vars, vars);
+	symtab = caller_symtab;
+	if (aliasing) {
+		// the byref args may have changed in the body, so they are
+		// written back again first; a value param is neither
+		sync(Quad::SYNCM);
+		quads.emplace_back(Quad::SYNCR, nullptr, quads.back().args);
+	}
+	return true;
+}
+
+static bool any_byref(const vector<VarSymbol*> &params)
+{
+	return any_of(params.begin(), params.end(), [](const VarSymbol *vs) {
+		return vs->isref;
+	});
+}
+
+// Statements in tail position, which leave nothing to do but return: for
+// a procedure the calls among them, and for a function the assignments of
+// a call of the same type to its result.  (A function that ends in a
+// procedure call still has its own result to return.)
+static void find_tail_calls(const Stmt *s, const ProcSymbol *proc, unordered_map<const Stmt*, ProcSymbol*> &calls);
+
+static void find_tail_calls(const vector<unique_ptr<Stmt>> &body, const ProcSymbol *proc, unordered_map<const Stmt*, ProcSymbol*> &calls)
+{
+	auto it = body.rbegin();
+	while (it != body.rend() && (*it)->kind == Stmt::EMPTY)
+		it++;
+	if (it != body.rend())
+		find_tail_calls(it->get(), proc, calls);
+}
+
+static void find_tail_calls(const Stmt *s, const ProcSymbol *proc, unordered_map<const Stmt*, ProcSymbol*> &calls)
+{
+	switch (s->kind) {
+	case Stmt::COMP:
+		find_tail_calls(static_cast<const CompStmt*>(s)->body, proc, calls);
+		break;
+	case Stmt::IF:
+		{
+			const IfStmt *t = static_cast<const IfStmt*>(s);
+			find_tail_calls(t->st.get(), proc, calls);
+			if (t->sf)
+				find_tail_calls(t->sf.get(), proc, calls);
+		}
+		break;
+	case Stmt::CALL:
+		if (!proc->rettype)
+			calls[s] = static_cast<const CallStmt*>(s)->proc;
+		break;
+	case Stmt::ASSIGN:
+		{
+			const AssignStmt *t = static_cast<const AssignStmt*>(s);
+			if (!proc->rettype || t->var->kind != Expr::SYM || t->val->kind != Expr::APPLY)
+				break;
+			// the result variable
+			const Symbol *var = static_cast<const SymExpr*>(t->var.get())->sym;
+			if (var->level != proc->level || var->name != proc->name+'$')
+				break;
+			ProcSymbol *func = static_cast<const ApplyExpr*>(t->val.get())->func;
+			if (func->rettype == proc->rettype)
+				calls[s] = func;
+		}
+		break;
+	default:
+		break;
+	}
 }
 
-void TranslateEnv::translate_call(ProcSymbol *proc, const vector<unique_ptr<Expr>> &args)
+// A call in tail position to the procedure itself assigns its params and
+// jumps back to the entry.  One to a sibling, which takes the same static
+// links, stores its args over those of this procedure and jumps there
+// once the frame is gone.  Either way no byref arg may point into the
+// frame.
+bool TranslateEnv::translate_tail_call(ProcSymbol *proc, const vector<unique_ptr<Expr>> &args)
 {
-	dynbitset visible_scalars(scalar_id);
-	int i=0;
+	ProcSymbol *self = symtab->proc;
+	if (proc != self) {
+		if (proc->level != level || proc->params.size() != params.size())
+			return false;
+		// inlining is better still
+		if (opt->optimize >= 2 && opt->inline_limit > 0 &&
+		    !scan_callee(*proc_blocks.at(proc), opt->inline_limit).why)
+			return false;
+	}
+	for (size_t i=0; i<args.size(); i++) {
+		const Expr *e = args[i].get();
+		if (!proc->params[i].byref)
+			continue;
+		if (e->kind == Expr::INDEX)
+			e = static_cast<const IndexExpr*>(e)->array.get();
+		const VarSymbol *vs = static_cast<const VarSymbol*>(static_cast<const SymExpr*>(e)->sym);
+		if (vs->level == level && !vs->isref)
+			return false;
+	}
+	// all args are evaluated, right to left, before any param changes
+	vector<TempOperand*> vals(args.size());
+	for (int i=int(args.size())-1; i>=0; i--) {
+		const Param &p = proc->params[i];
+		Expr *arg = args[i].get();
+		if (p.byref) {
+			MemOperand *m = translate_lvalue(arg);
+			vals[i] = newtemp(4);
+			quads.emplace_back(Quad::LEA, vals[i], mem(0, m->base, m->offset, m->index, m->scale));
+		} else {
+			vals[i] = newtemp(p.type->size());
+			quads.emplace_back(Quad::MOV, vals[i], resize(vals[i]->size, arg->translate(*this)));
+		}
+	}
+	ntailcalls++;
+	if (proc == self && !any_byref(params)) {
+		// the params stay in their temporaries
+		for (size_t i=0; i<params.size(); i++)
+			quads.emplace_back(Quad::MOV, scalar_temp[params[i]->scalar_id], vals[i]);
+		quads.emplace_back(Quad::JMP, tail_entry);
+		return true;
+	}
+	// as when returning, then the args go where the callee finds them
+	sync(Quad::SYNCM);
+	int nreg = proc == self ? 0 : regparm_nargs(proc);
+	for (int i=nreg; i<int(params.size()); i++)
+		quads.emplace_back(Quad::MOV, mem(vals[i]->size, ebp, params[i]->offset), vals[i]);
+	if (proc == self) {
+		quads.emplace_back(Quad::JMP, tail_entry);
+		return true;
+	}
+	int regs = 0;
+	for (int i=0; i<nreg; i++) {
+		quads.emplace_back(Quad::MOV, getphysreg(vals[i]->size, regparm_reg[i]), vals[i]);
+		regs |= 1 << regparm_reg[i];
+	}
+	// a sibling has the same static links
+	if (proc->regparm && level > 1) {
+		quads.emplace_back(Quad::MOV, ecx, display(level-1));
+		regs |= 1 << 1;
+	}
+	quads.emplace_back(Quad::TAILJMP, translate_sym(proc), regs ? imm(regs) : nullptr);
+	return true;
+}
+
+// the argument list of a SYNC quad
+Operand **TranslateEnv::synclist(const dynbitset &scalars)
+{
+	vector<int> ids = scalars.to_vector();
+	Operand **list = arena.make_array<Operand*>(ids.size()+1);
+	for (size_t i=0; i<ids.size(); i++)
+		list[i] = scalar_temp[ids[i]];
+	return list;
+}
+
+// returns the result of a function in a temporary, or nullptr
+Operand *TranslateEnv::translate_call(ProcSymbol *proc, const vector<unique_ptr<Expr>> &args)
+{
+	Operand *result;
+	if (inline_call(proc, args, result))
+		return result;
+	// scalars to write back before the call and to load again after it
+	dynbitset sync_out(scalar_id), sync_in(scalar_id);
 	assert(proc->params.size() == args.size());
-	for (auto it = args.rbegin(); it != args.rend(); it++) {
-		Expr *arg = it->get();
+	int nreg = regparm_nargs(proc);
+	vector<Operand*> regargs(nreg);
+	for (int i=int(args.size())-1; i>=0; i--) {
+		Expr *arg = args[i].get();
 		Operand *o;
 		if (proc->params[i].byref) {
 			if (opt->optimize) {
@@ -369,54 +811,68 @@ void TranslateEnv::translate_call(ProcSymbol *proc, const vector<unique_ptr<Expr
 					if (sym->kind == Symbol::VAR) {
 						VarSymbol *varsym = static_cast<VarSymbol*>(sym);
 						if (varsym->scalar_id >= 0) {
-							visible_scalars.set(varsym->scalar_id);
+							sync_out.set(varsym->scalar_id);
+							sync_in.set(varsym->scalar_id);
 						}
 					}
 				}
 			}
 			MemOperand *m = translate_lvalue(arg);
 			TempOperand *addr = newtemp(4);
-			m->size = 0;
-			quads.emplace_back(Quad::LEA, addr, m);
+			quads.emplace_back(Quad::LEA, addr, mem(0, m->base, m->offset, m->index, m->scale));
 			o = addr;
 		} else {
 			o = arg->translate(*this);
 		}
-		quads.emplace_back(Quad::PUSH, resize(4, o));
-		i++;
+		if (i < nreg) {
+			// the args still to come may change it
+			if (!o->isimm() && !proc->params[i].byref) {
+				TempOperand *t = newtemp(o->size);
+				quads.emplace_back(Quad::MOV, t, o);
+				o = t;
+			}
+			regargs[i] = resize(4, o);
+		} else {
+			quads.emplace_back(Quad::PUSH, resize(4, o));
+		}
 	}
 	assert(proc->level > 0 && proc->level <= level+1);
-	for (int i=1; i<proc->level; i++)
-		quads.emplace_back(Quad::PUSH, i == level ?
-				   static_cast<Operand*>(ebp) :
-				   static_cast<Operand*>(new MemOperand(4, ebp, 8+(i-1)*4)));
+	bool link = proc->regparm && proc->level > 1;
+	for (int i=1; i<proc->level-link; i++)
+		quads.emplace_back(Quad::PUSH, display(i));
 	//printf("proc %s level=%d\n", proc->name.c_str(), proc->level);
-	int spinc = (args.size()+(proc->level-1))*4;
-	Operand **synclist;
+	int spinc = (args.size()-nreg+(proc->level-1-link))*4;
 	if (opt->optimize) {
-#if 0
-		fprintf(stderr, "%s(%d) calls %s(%d)\n",
-			procname.c_str(), level,
-			proc->name.c_str(), proc->level);
-#endif
-		bool is_inner = proc->level > level;
-		int n = is_inner ? scalar_id : up ? int(up->scalar_temp.size()) : int(scalar_temp.size());
-		for (int i=0; i<n; i++)
-			visible_scalars.set(i);
-		vector<int> vec_visible_scalars = visible_scalars.to_vector();
-		
-		synclist = (Operand **) calloc(vec_visible_scalars.size()+1, sizeof *synclist);
-		n = vec_visible_scalars.size();
-		for (int i=0; i<n; i++)
-			synclist[i] = scalar_temp[vec_visible_scalars[i]];
-		quads.emplace_back(Quad::SYNCM, nullptr, synclist);
+		// only what the callee may read or write (see compute_modref())
+		const ModRef &mr = modref(proc);
+		for (const VarSymbol *vs: mr.ref)
+			sync_out.set(vs->scalar_id);
+		for (const VarSymbol *vs: mr.mod) {
+			sync_out.set(vs->scalar_id);
+			sync_in.set(vs->scalar_id);
+		}
+		quads.emplace_back(Quad::SYNCM, nullptr, synclist(sync_out));
 	}
-	quads.emplace_back(Quad::CALL, translate_sym(proc));
-	if (opt->optimize) {
-		quads.emplace_back(Quad::SYNCR, nullptr, synclist);
+	int regs = 0;
+	for (int i=0; i<nreg; i++) {
+		quads.emplace_back(Quad::MOV, getphysreg(4, regparm_reg[i]), regargs[i]);
+		regs |= 1 << regparm_reg[i];
 	}
+	if (link) {
+		quads.emplace_back(Quad::MOV, ecx, display(proc->level-1));
+		regs |= 1 << 1;
+	}
+	quads.emplace_back(Quad::CALL, translate_sym(proc), regs ? imm(regs) : nullptr);
+	if (opt->optimize)
+		quads.emplace_back(Quad::SYNCR, nullptr, synclist(sync_in));
 	if (spinc)
-		quads.emplace_back(Quad::ADD, esp, new ImmOperand(spinc));
+		quads.emplace_back(Quad::ADD, esp, imm(spinc));
+	if (!proc->rettype)
+		return nullptr;
+	int size = proc->rettype->size();
+	TempOperand *t = newtemp(size);
+	quads.emplace_back(Quad::MOV, t, resize(size, eax));
+	return t;
 }
 
 Operand *SymExpr::translate(TranslateEnv &env) const
@@ -426,7 +882,7 @@ Operand *SymExpr::translate(TranslateEnv &env) const
 
 Operand *LitExpr::translate(TranslateEnv &env) const
 {
-	return new ImmOperand(lit);
+	return env.imm(lit);
 }
 
 Operand *BinaryExpr::translate(TranslateEnv &env) const
@@ -460,15 +916,12 @@ Operand *IndexExpr::translate(TranslateEnv &env) const
 	assert(c->kind == Operand::MEM);
 	MemOperand *m_array = static_cast<MemOperand*>(c);
 	assert(!m_array->index);
-	m_array->size = type->size();
 	Operand *oindex = env.resize(4, index->translate(env));
 	if (oindex->kind == Operand::IMM) {
-		m_array->offset += static_cast<ImmOperand*>(oindex)->val * scale;
-	} else {
-		m_array->index = oindex;
-		m_array->scale = scale;
+		return env.mem(type->size(), m_array->base,
+			       m_array->offset + static_cast<ImmOperand*>(oindex)->val * scale);
 	}
-	return c;
+	return env.mem(type->size(), m_array->base, m_array->offset, oindex, scale);
 }
 
 Operand *UnaryExpr::translate(TranslateEnv &env) const
@@ -487,11 +940,7 @@ Operand *UnaryExpr::translate(TranslateEnv &env) const
 
 Operand *ApplyExpr::translate(TranslateEnv &env) const
 {
-	env.translate_call(func, args);
-	int size = type->size();
-	TempOperand *t = env.newtemp(size);
-	env.quads.emplace_back(Quad::MOV, t, env.resize(size, eax));
-	return t;
+	return env.translate_call(func, args);
 }
 
 void EmptyStmt::translate(TranslateEnv &env) const
@@ -509,6 +958,11 @@ void AssignStmt::translate(TranslateEnv &env) const
 {
 	Operand *ovar;
 	Symbol *varsym;
+	if (env.tail_calls.count(this)) {
+		const ApplyExpr *e = static_cast<ApplyExpr*>(val.get());
+		if (env.translate_tail_call(e->func, e->args))
+			return;
+	}
 	if (var->kind == Expr::SYM &&
 	    (varsym = static_cast<SymExpr*>(var.get())->sym)->kind == Symbol::PROC) {
 		ovar = env.translate_sym(env.lookup(varsym->name+'$'));
@@ -522,6 +976,8 @@ void AssignStmt::translate(TranslateEnv &env) const
 
 void CallStmt::translate(TranslateEnv &env) const
 {
+	if (env.tail_calls.count(this) && env.translate_tail_call(proc, args))
+		return;
 	env.translate_call(proc, args);
 }
 
@@ -569,6 +1025,25 @@ void ForStmt::translate(TranslateEnv &env) const
 	// lim = to;
 	TempOperand *lim = env.newtemp(indvar->type->size());
 	env.quads.emplace_back(Quad::MOV, lim, to->translate(env));
+	Quad::Op exit = down ? Quad::BLT : Quad::BGT;
+	if (env.opt->optimize >= 2) {
+		// if (indvar <= lim) do {
+		// 	<stmt>;
+		// 	indvar++;
+		// } while (indvar <= lim);
+		// the test at the bottom only runs once the loop has been entered,
+		// which reduce_iv() relies on
+		LabelOperand *lbody = env.newlabel();
+		LabelOperand *lend = env.newlabel();
+		env.quads.emplace_back(exit, lend, o_indvar, lim);
+		env.quads.emplace_back(Quad::LABEL, lbody);
+		body->translate(env);
+		env.quads.emplace_back(down ? Quad::SUB3 : Quad::ADD3,
+				       o_indvar, o_indvar, env.imm(1));
+		env.quads.emplace_back(down ? Quad::BGE : Quad::BLE, lbody, o_indvar, lim);
+		env.quads.emplace_back(Quad::LABEL, lend);
+		return;
+	}
 	// while (indvar <= lim) {
 	// 	<stmt>;
 	// 	indvar++;
@@ -576,47 +1051,46 @@ void ForStmt::translate(TranslateEnv &env) const
 	LabelOperand *lstart = env.newlabel();
 	LabelOperand *lend = env.newlabel();
 	env.quads.emplace_back(Quad::LABEL, lstart);
-	env.quads.emplace_back(down ? Quad::BLT : Quad::BGT, lend, o_indvar, lim);
+	env.quads.emplace_back(exit, lend, o_indvar, lim);
 	// <cond>
 	body->translate(env);
 	env.quads.emplace_back(down ? Quad::SUB3 : Quad::ADD3,
-			       o_indvar, o_indvar, new ImmOperand(1));
+			       o_indvar, o_indvar, env.imm(1));
 	env.quads.emplace_back(Quad::JMP, lstart);
 	env.quads.emplace_back(Quad::LABEL, lend);
 }
 
 void ReadStmt::translate(TranslateEnv &env) const
 {
-	static LabelOperand o_scanf(EP "scanf");
 	for (const unique_ptr<Expr> &var: vars) {
 		Expr *e = var.get();
 		MemOperand *m = env.translate_lvalue(e);
 		// nasm does not allow size prefix here
-		m->size = 0;
+		m = env.mem(0, m->base, m->offset, m->index, m->scale);
 		Operand *addr = env.newtemp(4);
 		env.quads.emplace_back(Quad::LEA, addr, m);
 		Operand *fmtstr;
 		if (e->type == int_type())
-			fmtstr = new LabelOperand("_$fmtsd");
+			fmtstr = env.label("_$fmtsd");
 		else if (e->type == char_type())
-			fmtstr = new LabelOperand("_$fmtsc");
+			fmtstr = env.label("_$fmtsc");
 		else
 			assert(0);
 		env.quads.emplace_back(Quad::PUSH, addr);
 		env.quads.emplace_back(Quad::PUSH, fmtstr);
-		env.quads.emplace_back(Quad::CALL, &o_scanf);
+		env.quads.emplace_back(Quad::CALL, env.label(EP "scanf"));
 		if (env.opt->optimize) {
 			if (e->kind == Expr::SYM) {
 				Symbol *s = static_cast<SymExpr*>(e)->sym;
 				assert(s->kind == Symbol::VAR);
 				int a = static_cast<VarSymbol*>(s)->scalar_id;
 				assert(a >= 0);
-				Operand **synclist = (Operand **) calloc(2, sizeof *synclist);
+				Operand **synclist = env.arena.make_array<Operand*>(2);
 				synclist[0] = env.scalar_temp[a];
 				env.quads.emplace_back(Quad::SYNCR, nullptr, synclist);
 			}
 		}
-		env.quads.emplace_back(Quad::ADD, esp, new ImmOperand(8));
+		env.quads.emplace_back(Quad::ADD, esp, env.imm(8));
 	}
 }
 
@@ -624,35 +1098,33 @@ static vector<string> strings;
 
 void WriteStmt::translate(TranslateEnv &env) const
 {
-	static LabelOperand o_printf(EP "printf");
-	static LabelOperand o_putchar(EP "putchar");
 	Operand *fmtstr;
 	if (!str.empty()) {
 		char strlabel[16];
 		sprintf(strlabel, "_$s%d", int(strings.size()));
 		strings.push_back(str);
-		fmtstr = new LabelOperand("_$fmtps");
-		env.quads.emplace_back(Quad::PUSH, new LabelOperand(strlabel));
+		fmtstr = env.label("_$fmtps");
+		env.quads.emplace_back(Quad::PUSH, env.label(strlabel));
 		env.quads.emplace_back(Quad::PUSH, fmtstr);
-		env.quads.emplace_back(Quad::CALL, &o_printf);
-		env.quads.emplace_back(Quad::ADD, esp, new ImmOperand(8));
+		env.quads.emplace_back(Quad::CALL, env.label(EP "printf"));
+		env.quads.emplace_back(Quad::ADD, esp, env.imm(8));
 	}
 	if (val) {
 		if (val->type == int_type())
-			fmtstr = new LabelOperand("_$fmtpd");
+			fmtstr = env.label("_$fmtpd");
 		else if (val->type == char_type())
-			fmtstr = new LabelOperand("_$fmtpc");
+			fmtstr = env.label("_$fmtpc");
 		else
 			assert(0);
 		env.quads.emplace_back(Quad::PUSH, env.resize(4, val->translate(env)));
 		env.quads.emplace_back(Quad::PUSH, fmtstr);
-		env.quads.emplace_back(Quad::CALL, &o_printf);
-		env.quads.emplace_back(Quad::ADD, esp, new ImmOperand(8));
+		env.quads.emplace_back(Quad::CALL, env.label(EP "printf"));
+		env.quads.emplace_back(Quad::ADD, esp, env.imm(8));
 	}
 	if (!str.empty() || val->type == int_type()) {
-		env.quads.emplace_back(Quad::PUSH, new ImmOperand(10));
-		env.quads.emplace_back(Quad::CALL, &o_putchar);
-		env.quads.emplace_back(Quad::ADD, esp, new ImmOperand(4));
+		env.quads.emplace_back(Quad::PUSH, env.imm(10));
+		env.quads.emplace_back(Quad::CALL, env.label(EP "putchar"));
+		env.quads.emplace_back(Quad::ADD, esp, env.imm(4));
 	}
 }
 
@@ -708,7 +1180,7 @@ void NegCond::translate(TranslateEnv &env, LabelOperand *ltrue, bool negate) con
 	sub->translate(env, ltrue, !negate);
 }
 
-void TranslateEnv::allocaddr()
+void TranslateEnv::allocaddr(bool nested)
 {
 	int offset = 0;
 	for (VarSymbol *vs: vars) {
@@ -717,6 +1189,25 @@ void TranslateEnv::allocaddr()
 		offset = (offset-size) & ~(align-1);
 		vs->offset = offset;
 	}
+	// the args that came in registers get a slot as well, unless they
+	// stay in their temporaries and no nested procedure can read them;
+	// these have offset 0 until translate_lvalue() needs one, if ever.
+	// Those left on the stack follow the static links pushed.
+	const ProcSymbol *proc = symtab->proc;
+	if (proc->regparm) {
+		int nreg = regparm_nargs(proc);
+		int nlink = level > 1;
+		bool home = !opt->optimize || nested || any_byref(params);
+		for (int i=0; i<int(params.size()); i++) {
+			if (i < nreg) {
+				if (home)
+					offset = (offset-4) & ~3;
+				params[i]->offset = home ? offset : 0;
+			} else {
+				params[i]->offset = 8+4*(level-1-nlink)+4*(i-nreg);
+			}
+		}
+	}
 	//offset &= ~3;
 	framesize = -offset;
 }
@@ -732,6 +1223,13 @@ void TranslateEnv::assign_scalar_id()
 		scalar_mem = up->scalar_mem;
 		temps = scalar_temp;
 		tempid = scalar_id;
+		// inherited scalars must stay unique in this procedure as well,
+		// and chars in the byte registers
+		for (TempOperand *t: scalar_temp) {
+			temp_table[temp_key(t->size, t->id)] = t;
+			if (t->size < 4)
+				part_temps.push_back(t->id);
+		}
 		for (int i=0; i<tempid; i++)
 			temp_scalar.push_back(i);
 	}
@@ -757,15 +1255,57 @@ void translate_block(const Block &blk, FILE *outfp, TranslateEnv *up, const Tran
 	//printf("begin %s\n", block_name);
 	//TranslateEnv env(symtab, block_name, outfp, framesize);
 	TranslateEnv env(blk.symtab, block_name, outfp, blk.params, blk.vars, up, opt);
+	if (blk.proc) {
+		proc_blocks[blk.proc] = &blk;
+		// set before any call to it is translated, which is in its
+		// body, or in a sub or a later sibling
+		blk.proc->regparm = opt->regparm;
+	}
 	if (blk.proc)
-		env.allocaddr();
+		env.allocaddr(!blk.subs.empty());
 	// else do nothing; main() has no local vars
 	if (opt->optimize)
 		env.assign_scalar_id();
 	for (const unique_ptr<Block> &sub: blk.subs)
 		translate_block(*sub, outfp, &env, opt);
+	if (opt->optimize && blk.proc) {
+		unordered_map<const Stmt*, ProcSymbol*> calls;
+		find_tail_calls(blk.stmts, blk.proc, calls);
+		for (const pair<const Stmt* const, ProcSymbol*> &c: calls) {
+			env.tail_calls.insert(c.first);
+			if (c.second == blk.proc && !env.tail_entry)
+				env.tail_entry = env.newlabel();
+		}
+	}
+	// a self tail call changing a byref param must sync the scalars again
+	bool reload = any_byref(blk.params);
+	// the args and static link passed in registers; unless that reload
+	// may happen, value params go straight to their temporaries
+	bool direct = opt->optimize && !(env.tail_entry && reload);
+	if (blk.proc && blk.proc->regparm) {
+		// the static link is spilled only if it must be
+		if (blk.proc->level > 1) {
+			env.link = env.newtemp(4);
+			env.quads.emplace_back(Quad::MOV, env.link, ecx);
+		}
+		int nreg = regparm_nargs(blk.proc);
+		for (int i=0; i<nreg; i++) {
+			VarSymbol *vs = blk.params[i];
+			TempOperand *r = getphysreg(4, regparm_reg[i]);
+			if (direct && !vs->isref) {
+				TempOperand *t = env.scalar_temp[vs->scalar_id];
+				env.quads.emplace_back(Quad::MOV, t, env.resize(t->size, r));
+			} else {
+				env.quads.emplace_back(Quad::MOV, env.mem(4, ebp, vs->offset), r);
+			}
+		}
+	}
+	if (env.tail_entry && reload)
+		env.quads.emplace_back(Quad::LABEL, env.tail_entry);
 	if (opt->optimize)
-		env.sync(Quad::SYNCR);
+		env.sync(Quad::SYNCR, direct);
+	if (env.tail_entry && !reload)
+		env.quads.emplace_back(Quad::LABEL, env.tail_entry);
 	for (const unique_ptr<Stmt> &stmt: blk.stmts)
 		stmt->translate(env);
 	if (opt->optimize)
@@ -780,13 +1320,36 @@ void translate_block(const Block &blk, FILE *outfp, TranslateEnv *up, const Tran
 			env.quads.emplace_back(Quad::MOV, getphysreg(rvsize, 0), env.resize(rvsize, env.translate_sym(retval)));
 		}
 	}
-	if (opt->optimize) {
-		env.insert_sync();
-		if (opt->optimize >= 2)
-			env.optimize();
+	env.run_passes();
+	if (opt->stats) {
+		fprintf(stderr, "%s: IR arena %zu bytes used, %zu reserved\n",
+			block_name, env.arena.used(), env.arena.reserved());
+		fprintf(stderr, "%s: %d moves coalesced\n",
+			block_name, env.nmove_removed);
+		fprintf(stderr, "%s: %d redundant quads eliminated\n",
+			block_name, env.neliminated);
+		fprintf(stderr, "%s: %d copies propagated\n",
+			block_name, env.npropagated);
+		fprintf(stderr, "%s: %d loop-invariant quads hoisted\n",
+			block_name, env.nhoisted);
+		fprintf(stderr, "%s: %d induction variables strength-reduced\n",
+			block_name, env.nreduced);
+		fprintf(stderr, "%s: %d dead quads removed\n",
+			block_name, env.ndead);
+		fprintf(stderr, "%s: %d tail calls made jumps\n",
+			block_name, env.ntailcalls);
+		if (env.fpo)
+			fprintf(stderr, "%s: frame pointer omitted\n", block_name);
+		for (const string &line: env.inline_log)
+			fprintf(stderr, "%s: %s\n", block_name, line.c_str());
+		if (!env.peephole_hits.empty()) {
+			fprintf(stderr, "%s: peephole rules applied:", block_name);
+			for (const pair<const char*,int> &h: env.peephole_hits)
+				fprintf(stderr, " %s %d", h.first, h.second);
+			fputc('\n', stderr);
+		}
 	}
-	env.lower();
-	env.gencode();
+	env.arena.release();
 	//printf("end %s\n", block_name);
 }
 
@@ -816,6 +1379,8 @@ void translate_all(unique_ptr<Block> &&blk, const TranslateOptions *opt)
 		fprintf(outfp, "\tres%c\t%d\n", sizechar(align), type->size()/align);
 	}
 	fputs("\n\tsection\t.text\n", outfp);
+	if (opt->optimize)
+		compute_modref(*blk);
 	translate_block(*blk, outfp, nullptr, opt);
 	//blk->print(0);
 	fputs("\n"
@@ -838,53 +1403,74 @@ void translate_all(unique_ptr<Block> &&blk, const TranslateOptions *opt)
 	fclose(outfp);
 }
 
-void TranslateEnv::rewrite_mem(MemOperand *m)
+MemOperand *TranslateEnv::rewrite_mem(MemOperand *m)
 {
-	auto check = [this](Operand *&o) {
+	auto check = [this](Operand *o) -> Operand * {
 		if (o && o->ismem()) {
-			MemOperand *m = static_cast<MemOperand*>(o);
-			rewrite_mem(m);
+			MemOperand *m = rewrite_mem(static_cast<MemOperand*>(o));
 			assert(m->size == 4);
 			TempOperand *t = newtemp(4);
 			quads.emplace_back(Quad::MOV, t, m);
-			o = t;
+			return t;
 		}
+		return o;
 	};
-	check(m->base);
-	check(m->index);
+	Operand *base = check(m->base);
+	Operand *index = check(m->index);
+	return mem(m->size, base, m->offset, index, m->scale);
 };
 
-void TranslateEnv::try_rewrite_mem(Operand *o)
+void TranslateEnv::try_rewrite_mem(Operand *&o)
 {
 	if (o && o->ismem())
-		rewrite_mem(asmem(o));
+		o = rewrite_mem(asmem(o));
 };
 
 // eliminate invalid combination of opcode and operands, such as
 //   mov     MEM, MEM
 //   idiv    IMM
 //   cmp     IMM, _
-void TranslateEnv::rewrite()
+// returns the new position of each old quad; one past the end maps to the new end
+vector<int> TranslateEnv::rewrite()
 {
 	vector<Quad> oldquads = move(quads);
 	quads.clear();
+	vector<int> newpos(oldquads.size()+1);
 	// no const here, we may modify q
-	for (Quad &q: oldquads) {
-		if (q.op == Quad::MOV && q.c->tostr() == q.a->tostr())
+	for (size_t i=0; i<oldquads.size(); i++) {
+		Quad &q = oldquads[i];
+		newpos[i] = quads.size();
+		// a move into a register is kept, as it may be the return value
+		// at the end, which must stay live (gencode() drops the move)
+		if (q.op == Quad::MOV && q.c == q.a && !(q.c->istemp() && astemp(q.c)->id < 0)) {
+			nmove_removed++;
 			continue;
+		}
 		try_rewrite_mem(q.c);
 		try_rewrite_mem(q.a);
 		try_rewrite_mem(q.b);
+		Operand *store = nullptr; // spilled destination of movsx/lea/imul
 		switch (q.op) {
 		case Quad::ADD:
 		case Quad::SUB:
-		case Quad::MULW:
 		case Quad::MOV:
+		case Quad::SHL:
+		case Quad::SAR:
+		case Quad::SHR:
 			// op c,a
 			assert(q.c->istemp() || q.c->ismem());
 			if (q.c->ismem() && q.a->ismem())
 				q.a = totemp(q.a);
 			break;
+		case Quad::MULW:
+			// imul c,a
+			// c must be a register
+			assert(q.c->istemp() || q.c->ismem());
+			if (q.c->ismem()) {
+				store = q.c;
+				q.c = totemp(q.c);
+			}
+			break;
 		case Quad::DIVW:
 		case Quad::DIVB:
 		case Quad::NEG:
@@ -910,24 +1496,32 @@ void TranslateEnv::rewrite()
 					q.a = totemp(q.a);
 				} else {
 					swap(q.a, q.b);
-					if (q.op >= Quad::BLT)
-						q.op = Quad::Op(q.op^1);
+					q.op = Quad::swapped(q.op);
 				}
 			}
 			break;
 		case Quad::SEX:
 			// movsx c,a
-			assert(q.c->istemp());
+			// c must be a register
 			assert(q.a->istemp() || q.a->ismem());
+			if (q.c->ismem()) {
+				store = q.c;
+				q.c = newtemp(q.c->size);
+			}
 			break;
 		case Quad::JMP:
 		case Quad::CALL:
+		case Quad::TAILJMP:
 			assert(q.c->islabel());
 			break;
 		case Quad::LEA:
 			// lea c,a
-			assert(q.c->istemp());
+			// c must be a register
 			assert(q.a->ismem());
+			if (q.c->ismem()) {
+				store = q.c;
+				q.c = newtemp(q.c->size);
+			}
 			break;
 		case Quad::PUSH:
 			// push c
@@ -940,6 +1534,13 @@ void TranslateEnv::rewrite()
 			if (q.c->isimm())
 				q.c = totemp(q.c);
 			break;
+		case Quad::MULL:
+			// imul c
+			// c is r/m32
+			assert(q.c->size == 4);
+			if (q.c->isimm())
+				q.c = totemp(q.c);
+			break;
 		case Quad::CDQ:
 		case Quad::CBW:
 		case Quad::LABEL:
@@ -949,20 +1550,31 @@ void TranslateEnv::rewrite()
 			assert(0);
 		}
 		quads.emplace_back(q);
+		if (store)
+			quads.emplace_back(Quad::MOV, store, q.c);
 	}
+	newpos[oldquads.size()] = quads.size();
+	return newpos;
 }
 
-void TranslateEnv::sync(Quad::Op op)
+// The scalars shared with other procedures, and memory: those of the
+// enclosing ones and the params.  A value param needs no writing back; nor
+// loading if it came in a register, when regs_loaded (see translate_block()).
+void TranslateEnv::sync(Quad::Op op, bool regs_loaded)
 {
 	if (up) {
 		int n = up->scalar_id;
+		int nreg = regs_loaded ? regparm_nargs(symtab->proc) : 0;
 		vector<int> byref_scalars;
-		for (VarSymbol *vs: params) {
+		for (size_t i=0; i<params.size(); i++) {
+			VarSymbol *vs = params[i];
 			assert(vs->scalar_id >= 0);
+			if (!vs->isref && (op == Quad::SYNCM || int(i) < nreg))
+				continue;
 			byref_scalars.push_back(vs->scalar_id);
 		}
 		int m = byref_scalars.size();
-		Operand **args = (Operand **) calloc(n+m+1, sizeof *args);
+		Operand **args = arena.make_array<Operand*>(n+m+1);
 		for (int i=0; i<n; i++)
 			args[i] = scalar_temp[i];
 		for (int i=0; i<m; i++)
@@ -971,6 +1583,130 @@ void TranslateEnv::sync(Quad::Op op)
 	}
 }
 
+// the value of an immediate operand of the given size, sign-extended
+static int immval(Operand *o, int size)
+{
+	int v = static_cast<ImmOperand*>(o)->val;
+	return size == 1 ? int8_t(v) : v;
+}
+
+// Hacker's Delight, 10-1: the multiplier m and shift s such that n/d is
+// the high word of m*n shifted right by s (and adjusted, see below), for
+// 2 <= |d| < 2^31
+static void div_magic(int d, int &m, int &s)
+{
+	const uint32_t two31 = 0x80000000;
+	uint32_t ad = d < 0 ? -uint32_t(d) : d;
+	uint32_t t = two31 + (uint32_t(d) >> 31);
+	uint32_t anc = t - 1 - t%ad;
+	uint32_t q1 = two31/anc, r1 = two31 - q1*anc;
+	uint32_t q2 = two31/ad, r2 = two31 - q2*ad;
+	uint32_t delta;
+	int p = 31;
+	do {
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= ad) {
+			q2++;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	m = q2+1;
+	if (d < 0)
+		m = -m;
+	s = p-32;
+}
+
+// c = a*k by a shift, an lea (add for bytes) or both when k is 2^n times
+// 1, 3, 5 or 9, negated if k is negative
+bool TranslateEnv::lower_mul_imm(Operand *c, Operand *a, int k)
+{
+	int size = c->size;
+	if (!k) {
+		quads.emplace_back(Quad::MOV, c, imm(0, size));
+		return true;
+	}
+	uint32_t u = k < 0 ? -uint32_t(k) : k;
+	int shift = 0;
+	for (; !(u & 1); u >>= 1)
+		shift++;
+	if (u != 1 && u != 3 && u != 5 && u != 9)
+		return false;
+	TempOperand *t = newtemp(size);
+	if (u == 1) {
+		quads.emplace_back(Quad::MOV, t, a);
+	} else if (size == 4) {
+		Operand *x = a->istemp() && astemp(a)->id >= 0 ? a : totemp(a);
+		quads.emplace_back(Quad::LEA, t, mem(0, x, 0, x, u-1));
+	} else {
+		quads.emplace_back(Quad::MOV, t, a);
+		quads.emplace_back(Quad::SHL, t, imm(u == 3 ? 1 : u == 5 ? 2 : 3));
+		quads.emplace_back(Quad::ADD, t, a);
+	}
+	if (shift)
+		quads.emplace_back(Quad::SHL, t, imm(shift));
+	if (k < 0)
+		quads.emplace_back(Quad::NEG, t);
+	quads.emplace_back(Quad::MOV, c, t);
+	return true;
+}
+
+// c = a/d, rounding toward zero like idiv.  A power of two is a shift,
+// once 2^n-1 is added to a negative dividend; other divisors multiply by
+// a magic number, which leaves the quotient in edx instead of eax and edx
+// both being taken by idiv.  Bytes are divided as words.  Division by 0
+// or -1 is left to idiv, which traps as dce() and sccp() expect.
+bool TranslateEnv::lower_div_imm(Operand *c, Operand *a, int d)
+{
+	if (d == 0 || d == -1 || d == INT32_MIN || a->isimm())
+		return false;
+	Operand *n = resize(4, a);
+	if (n->istemp() && astemp(n)->id < 0)
+		n = totemp(n);
+	uint32_t ad = d < 0 ? -uint32_t(d) : d;
+	TempOperand *q = newtemp(4);
+	if (!(ad & (ad-1))) {
+		int k = 0;
+		while (ad >> k != 1)
+			k++;
+		quads.emplace_back(Quad::MOV, q, n);
+		if (k) {
+			if (k > 1)
+				quads.emplace_back(Quad::SAR, q, imm(31));
+			quads.emplace_back(Quad::SHR, q, imm(32-k));
+			quads.emplace_back(Quad::ADD, q, n);
+			quads.emplace_back(Quad::SAR, q, imm(k));
+		}
+		if (d < 0)
+			quads.emplace_back(Quad::NEG, q);
+	} else {
+		int m, s;
+		div_magic(d, m, s);
+		quads.emplace_back(Quad::MOV, eax, imm(m));
+		quads.emplace_back(Quad::MULL, n);
+		if (d > 0 && m < 0)
+			quads.emplace_back(Quad::ADD, edx, n);
+		else if (d < 0 && m > 0)
+			quads.emplace_back(Quad::SUB, edx, n);
+		if (s)
+			quads.emplace_back(Quad::SAR, edx, imm(s));
+		// add one if the quotient is negative
+		quads.emplace_back(Quad::MOV, q, edx);
+		quads.emplace_back(Quad::SHR, q, imm(31));
+		quads.emplace_back(Quad::ADD, q, edx);
+	}
+	quads.emplace_back(Quad::MOV, c, resize(c->size, q));
+	return true;
+}
+
 void TranslateEnv::lower()
 {
 	vector<Quad> oldquads(move(quads));
@@ -979,6 +1715,10 @@ void TranslateEnv::lower()
 		case Quad::ADD3:
 		case Quad::SUB3:
 		case Quad::MUL3:
+			if (q.op == Quad::MUL3 &&
+			    (q.b->isimm() ? lower_mul_imm(q.c, q.a, immval(q.b, q.c->size)) :
+			     q.a->isimm() && lower_mul_imm(q.c, q.b, immval(q.a, q.c->size))))
+				break;
 			if (q.op == Quad::MUL3 && q.c->size != 4) {
 				// mov al,a
 				// imul b
@@ -993,6 +1733,8 @@ void TranslateEnv::lower()
 			}
 			break;
 		case Quad::DIV3:
+			if (q.b->isimm() && lower_div_imm(q.c, q.a, immval(q.b, q.c->size)))
+				break;
 			if (q.c->size == 4) {
 				quads.emplace_back(Quad::MOV, eax, q.a);
 				quads.emplace_back(Quad::CDQ);
@@ -1,3 +1,15 @@
+#pragma once
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "arena.h"
+#include "dynbitset.h"
+
 struct TranslateEnv;
 
 struct Operand {
@@ -25,6 +37,7 @@ struct ImmOperand: Operand
 {
 	int val;
 	ImmOperand(int val): Operand(IMM, 4), val(val) {}
+	ImmOperand(int val, int size): Operand(IMM, size), val(val) {}
 	std::string tostr() const override;
 };
 
@@ -37,8 +50,10 @@ struct TempOperand: Operand
 
 struct LabelOperand: Operand
 {
+	int id; // local label number (printed as .l<id>), or -1 for a named label
 	std::string label;
-	LabelOperand(const std::string &label): Operand(LABEL, 4), label(label) {}
+	LabelOperand(int id): Operand(LABEL, 4), id(id) {}
+	LabelOperand(const std::string &label): Operand(LABEL, 4), id(-1), label(label) {}
 	std::string tostr() const override;
 };
 
@@ -65,6 +80,10 @@ struct MemOperand: Operand
 	std::string tostr() const override;
 };
 
+// Operands of a procedure are interned by TranslateEnv (see imm(), temp(),
+// label() and mem()) and must not be modified once created, so two operands
+// are equal iff they are the same object.
+
 // at most one temporary (non-physreg) is defined at a time
 struct Quad {
 	enum Op {
@@ -81,7 +100,7 @@ struct Quad {
 		NEG,
 		MOV,
 		JMP,
-		CALL,
+		CALL, // a: the registers holding args, as a bit mask (see translate_call())
 		LEA,
 		PUSH,
 		INC,
@@ -91,6 +110,12 @@ struct Quad {
 		CBW,
 		MULB,
 		DIVB,
+		XOR,
+		SHL,
+		SAR,
+		SHR,
+		MULL,
+		TAILJMP, // leave the frame and jump to procedure c; a as for CALL
 		ADD3,
 		SUB3,
 		MUL3,
@@ -102,6 +127,7 @@ struct Quad {
 		SYNCR,
 	} op;
 	Operand *c;
+	// a branch without b tests a against 0 (see peephole())
 	union {
 		Operand *a;
 		Operand **args; // NULL-terminated
@@ -133,6 +159,16 @@ struct Quad {
 		}
 		return false;
 	}
+	// BEQ..BLE come in pairs of a condition and its negation
+	static Op negated(Op op)
+	{
+		return Op(BEQ + ((op-BEQ)^1));
+	}
+	// the branch with the same outcome once a and b are exchanged
+	static Op swapped(Op op)
+	{
+		return op < BLT ? op : Op(BLT + (op-BLT+2)%4);
+	}
 	bool is_jump_or_branch() const
 	{
 		switch (op) {
@@ -154,19 +190,60 @@ struct Symbol;
 struct SymbolTable;
 struct ProcSymbol;
 struct Expr;
+struct Stmt;
 
 struct TranslateOptions {
 	int optimize = 0; // optimization level
+	bool stats = false; // print per-procedure statistics to stderr
 	std::string out_fname;
+	std::vector<std::string> passes; // pipeline, see setup_pipeline()
+	std::vector<std::string> dump_after; // pass names, or "all"
+	int inline_limit = 20; // largest body inlined at -O2, in AST nodes
+	bool regparm = false; // pass args and the static link in registers
 };
 
+bool setup_pipeline(TranslateOptions &opt, const char *passes);
+bool setup_dumps(TranslateOptions &opt, const char *names);
+
 struct VarSymbol;
+struct BB;
 struct Graph;
+struct Liveness;
 class TranslateEnv {
+	struct MemKey {
+		int size;
+		Operand *base;
+		int offset;
+		Operand *index;
+		int scale;
+		bool operator==(const MemKey &that) const
+		{
+			return size == that.size &&
+				base == that.base &&
+				offset == that.offset &&
+				index == that.index &&
+				scale == that.scale;
+		}
+	};
+	struct MemKeyHash {
+		size_t operator()(const MemKey &k) const
+		{
+			size_t h = std::hash<Operand*>()(k.base);
+			h = h*31 + std::hash<Operand*>()(k.index);
+			h = h*31 + k.offset;
+			h = h*31 + k.scale;
+			return h*31 + k.size;
+		}
+	};
+	std::unordered_map<long long, ImmOperand*> imm_table;
+	std::unordered_map<long long, TempOperand*> temp_table;
+	std::unordered_map<std::string, LabelOperand*> label_table;
+	std::unordered_map<MemKey, MemOperand*, MemKeyHash> mem_table;
 	SymbolTable *symtab;
 	std::string procname; // decorated name
 	FILE *outfp;
 	int framesize = 0;
+	unsigned char used_regs = 0; // registers assigned by regalloc()
 	int level; // 1 for top level
 	int tempid = 0;
 	int labelid = 0;
@@ -179,30 +256,57 @@ class TranslateEnv {
 	std::vector<VarSymbol*> scalar_var;
 	std::vector<MemOperand*> scalar_mem;
 	std::vector<TempOperand*> temps;
+	std::unordered_map<const VarSymbol*, Operand*> inline_vars; // of the callee being inlined
 	TranslateEnv *up;
 	int scalar_id; // after construction, number of visible scalars (explicitly defined)
 
 	void emit(const char *ins, Operand *dst, Operand *src);
 	void emit(const char *ins, Operand *dst);
 	void emit(const char *ins);
-	Operand *resolve(Operand *o);
+	Operand *resolve(Operand *o, bool spilled_only = false);
+	Operand *rebase(Operand *o);
+	void sink_entry_loads();
+	void shrink_wrap(unsigned char saved, int &save_at, int &restore_at);
 	TempOperand *totemp(Operand *o); // emit quads to load o into a temporary
 	void sync_mem(int a);
 	void sync_reg(int a);
 
 public:
+	Arena arena; // owns every operand and argument list of this procedure
+	int nmove_removed = 0; // register-to-register moves dropped after allocation
+	int neliminated = 0; // redundant quads deleted by gvn()
+	int npropagated = 0; // copies deleted by gvn()
+	int ndead = 0; // dead quads deleted by dce()
+	int nhoisted = 0; // quads moved out of loops by licm()
+	int nreduced = 0; // induction variables made by reduce_iv()
+	int ntailcalls = 0; // calls made jumps by translate_tail_call()
+	bool fpo = false; // no frame pointer, the frame is addressed off esp (see regalloc())
+	std::vector<std::pair<const char*,int>> peephole_hits; // rule, times applied
+	std::vector<std::string> inline_log; // a line per call considered by inline_call()
+	std::unordered_set<const Stmt*> tail_calls; // see find_tail_calls()
+	LabelOperand *tail_entry = nullptr; // target of self tail calls
+	TempOperand *link = nullptr; // the innermost static link if passed in ecx
 	std::vector<Quad> quads;
+	std::vector<std::unique_ptr<BB>> blocks; // quads in CFG form, while CFG passes run
 	std::vector<TempOperand*> scalar_temp;
 	const TranslateOptions *opt;
 
+	// uniquing constructors for operands
+	ImmOperand *imm(int val, int size = 4);
+	TempOperand *temp(int size, int id);
+	LabelOperand *label(const std::string &name);
+	MemOperand *mem(int size, Operand *base, int offset = 0, Operand *index = nullptr, int scale = 0);
 	TempOperand *newtemp(int size);
 	TempOperand *newtemp_scalar(int size, int scalar);
 	LabelOperand *newlabel();
 	Symbol *lookup(const std::string &name) const;
 	Operand *translate_sym(const Symbol *sym);
 	MemOperand *translate_varsym(const VarSymbol *sym);
+	Operand *display(int i);
 	MemOperand *translate_lvalue(const Expr *e);
-	void translate_call(ProcSymbol *proc, const std::vector<std::unique_ptr<Expr>> &args);
+	Operand *translate_call(ProcSymbol *proc, const std::vector<std::unique_ptr<Expr>> &args);
+	bool translate_tail_call(ProcSymbol *proc, const std::vector<std::unique_ptr<Expr>> &args);
+	bool inline_call(ProcSymbol *proc, const std::vector<std::unique_ptr<Expr>> &args, Operand *&result);
 	int physreg(const TempOperand *t);
 	Operand *resize(int size, Operand *o);
 	TranslateEnv(SymbolTable *symtab,
@@ -212,18 +316,37 @@ public:
 		     const std::vector<VarSymbol*> &vars,
 		     TranslateEnv *up,
 		     const TranslateOptions *opt);
+	void run_passes();
+	void build_cfg();
+	void linearize();
+	void dump(const char *pass);
+	void regalloc();
+	void peephole();
 	void gencode();
-	void rewrite();
-	void rewrite_mem(MemOperand *m);
-	void try_rewrite_mem(Operand *o);
-	void allocaddr();
+	std::vector<int> rewrite();
+	MemOperand *rewrite_mem(MemOperand *m);
+	void try_rewrite_mem(Operand *&o);
+	void allocaddr(bool nested);
 	void assign_scalar_id();
-	void optimize();
-	void sync(Quad::Op op);
+	void to_ssa();
+	void sccp();
+	void gvn();
+	void insert_preheaders();
+	void licm();
+	void reduce_iv();
+	void dce();
+	void from_ssa();
+	void sync(Quad::Op op, bool regs_loaded = false);
+	Operand **synclist(const dynbitset &scalars);
 	void insert_sync();
 	void lower();
+	bool lower_mul_imm(Operand *c, Operand *a, int k);
+	bool lower_div_imm(Operand *c, Operand *a, int d);
 	void dump_quads();
-	Graph build_interference_graph();
+	Graph build_interference_graph(Liveness &lv);
+	Graph update_interference_graph(Liveness &lv, const std::vector<int> &newpos, const std::vector<int> &color, const Graph &last);
+	std::vector<float> spill_costs(std::vector<char> &free_spill);
+	std::vector<std::pair<int,int>> collect_moves() const;
 };
 
 extern const char *regname4[8];
@@ -236,6 +359,16 @@ TempOperand *getphysreg(int size, int id);
 struct Block;
 void translate_all(std::unique_ptr<Block> &&blk, const TranslateOptions *options);
 
+// scalars of enclosing procedures, globals included, that a call may
+// read or write, see modref.cpp
+struct ModRef {
+	std::unordered_set<const VarSymbol*> ref, mod;
+};
+void compute_modref(const Block &prog);
+const ModRef &modref(const ProcSymbol *proc);
+// whether a byref param may point to the scalar vs
+bool is_aliased(const VarSymbol *vs);
+
 void todo(const char *file, int line, const char *msg);
 #define TODO(msg) todo(__FILE__, __LINE__, msg)
 